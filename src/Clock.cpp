@@ -0,0 +1,97 @@
+#include "Clock.hpp"
+#include <time.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define AGGREGATOR_HAS_TSC
+#endif
+
+using namespace aggregator;
+
+namespace
+{
+    base::Time readClock(clockid_t clock)
+    {
+        timespec ts;
+        clock_gettime(clock, &ts);
+        return base::Time::fromMicroseconds(static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
+    }
+
+    struct NullDeleter
+    {
+        void operator()(Clock*) const {}
+    };
+}
+
+boost::shared_ptr<Clock> Clock::getSystemClock()
+{
+    static SystemClock clock;
+    return boost::shared_ptr<Clock>(&clock, NullDeleter());
+}
+
+base::Time SystemClock::now() const
+{
+    return base::Time::now();
+}
+
+CoarseMonotonicClock::CoarseMonotonicClock()
+    : offset(base::Time::now() - readClock(CLOCK_MONOTONIC_COARSE))
+{
+}
+
+base::Time CoarseMonotonicClock::now() const
+{
+    return readClock(CLOCK_MONOTONIC_COARSE) + offset;
+}
+
+TscClock::TscClock(base::Time calibration_time)
+    : tsc_zero(0), microseconds_per_tick(0)
+{
+#ifdef AGGREGATOR_HAS_TSC
+    base::Time start = readClock(CLOCK_MONOTONIC);
+    uint64_t tsc_start = __rdtsc();
+    base::Time end;
+    do
+    {
+        end = readClock(CLOCK_MONOTONIC);
+    }
+    while (end - start < calibration_time);
+    uint64_t tsc_end = __rdtsc();
+
+    microseconds_per_tick = static_cast<double>((end - start).toMicroseconds()) / (tsc_end - tsc_start);
+    tsc_zero = tsc_end;
+    offset = base::Time::now();
+#else
+    offset = base::Time::now() - readClock(CLOCK_MONOTONIC);
+#endif
+}
+
+base::Time TscClock::now() const
+{
+#ifdef AGGREGATOR_HAS_TSC
+    uint64_t ticks = __rdtsc() - tsc_zero;
+    return offset + base::Time::fromMicroseconds(static_cast<int64_t>(ticks * microseconds_per_tick));
+#else
+    return readClock(CLOCK_MONOTONIC) + offset;
+#endif
+}
+
+SimulatedClock::SimulatedClock(base::Time time)
+    : time(time)
+{
+}
+
+base::Time SimulatedClock::now() const
+{
+    return time;
+}
+
+void SimulatedClock::setTime(base::Time time)
+{
+    this->time = time;
+}
+
+void SimulatedClock::advance(base::Time duration)
+{
+    time = time + duration;
+}
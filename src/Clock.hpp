@@ -0,0 +1,97 @@
+#ifndef AGGREGATOR_CLOCK_HPP
+#define AGGREGATOR_CLOCK_HPP
+
+#include <base/Time.hpp>
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+
+namespace aggregator
+{
+    /** Interface for the sources of wall-clock time used by the stream
+     * aligner and the timestamp estimator
+     *
+     * All implementations return times on the same base than
+     * base::Time::now(), so that they can be compared with sample
+     * timestamps.
+     */
+    class Clock
+    {
+    public:
+        virtual ~Clock() {}
+
+        /** The current time */
+        virtual base::Time now() const = 0;
+
+        /** A shared instance of SystemClock. This is the default clock */
+        static boost::shared_ptr<Clock> getSystemClock();
+    };
+
+    typedef boost::shared_ptr<Clock> ClockPtr;
+
+    /** Clock that uses base::Time::now() */
+    class SystemClock : public Clock
+    {
+    public:
+        base::Time now() const;
+    };
+
+    /** Clock based on CLOCK_MONOTONIC_COARSE
+     *
+     * It is much cheaper to read than the system clock, but has the
+     * resolution of the kernel tick (usually 1 to 4ms). It is offset to match
+     * the system clock at construction time, and does not follow changes of
+     * the system clock afterwards.
+     */
+    class CoarseMonotonicClock : public Clock
+    {
+    public:
+        CoarseMonotonicClock();
+        base::Time now() const;
+
+    private:
+        base::Time offset;
+    };
+
+    /** Clock based on the processor's time stamp counter
+     *
+     * Reading it costs a few nanoseconds. It requires a constant and
+     * synchronized TSC, which is the case on modern x86 processors. The
+     * TSC frequency is calibrated against CLOCK_MONOTONIC in the constructor,
+     * which therefore blocks for \c calibration_time. On other architectures,
+     * it falls back to CLOCK_MONOTONIC.
+     *
+     * Like CoarseMonotonicClock, it is offset to match the system clock at
+     * construction time.
+     */
+    class TscClock : public Clock
+    {
+    public:
+        explicit TscClock(base::Time calibration_time = base::Time::fromMilliseconds(10));
+        base::Time now() const;
+
+    private:
+        base::Time offset;
+        uint64_t tsc_zero;
+        double microseconds_per_tick;
+    };
+
+    /** Clock that only changes when told to
+     *
+     * It allows simulations to run the time-dependent features faster (or
+     * slower) than real time.
+     */
+    class SimulatedClock : public Clock
+    {
+    public:
+        explicit SimulatedClock(base::Time time = base::Time());
+        base::Time now() const;
+
+        void setTime(base::Time time);
+        void advance(base::Time duration);
+
+    private:
+        base::Time time;
+    };
+}
+
+#endif
@@ -0,0 +1,98 @@
+#include "LatencyHistogram.hpp"
+#include <algorithm>
+#include <cmath>
+
+using namespace aggregator;
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::reset()
+{
+    std::fill(buckets, buckets + BUCKET_COUNT, 0);
+    count = 0;
+    min = 0;
+    max = 0;
+    sum = 0;
+}
+
+int LatencyHistogram::getBucketIndex(uint64_t value)
+{
+    if (value < static_cast<uint64_t>(SUB_BUCKETS))
+        return value;
+
+    int magnitude = 63 - __builtin_clzll(value);
+    if (magnitude > MAX_MAGNITUDE)
+        return BUCKET_COUNT - 1;
+
+    int shift = magnitude - SUB_BUCKET_BITS + 1;
+    int sub_bucket = (value >> shift) - SUB_BUCKETS / 2;
+    return SUB_BUCKETS + (magnitude - SUB_BUCKET_BITS) * (SUB_BUCKETS / 2) + sub_bucket;
+}
+
+uint64_t LatencyHistogram::getBucketUpperBound(int index)
+{
+    if (index < SUB_BUCKETS)
+        return index;
+
+    int k = index - SUB_BUCKETS;
+    int magnitude = SUB_BUCKET_BITS + k / (SUB_BUCKETS / 2);
+    uint64_t sub_bucket = SUB_BUCKETS / 2 + k % (SUB_BUCKETS / 2);
+    int shift = magnitude - SUB_BUCKET_BITS + 1;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::recordMicroseconds(int64_t value)
+{
+    if (value < 0)
+        value = 0;
+
+    buckets[getBucketIndex(value)]++;
+    if (count == 0 || value < min)
+        min = value;
+    if (count == 0 || value > max)
+        max = value;
+    sum += value;
+    count++;
+}
+
+base::Time LatencyHistogram::getMin() const
+{
+    return base::Time::fromMicroseconds(min);
+}
+
+base::Time LatencyHistogram::getMax() const
+{
+    return base::Time::fromMicroseconds(max);
+}
+
+base::Time LatencyHistogram::getMean() const
+{
+    if (count == 0)
+        return base::Time();
+    return base::Time::fromMicroseconds(sum / count);
+}
+
+base::Time LatencyHistogram::getPercentile(double ratio) const
+{
+    if (count == 0)
+        return base::Time();
+
+    uint64_t rank = std::ceil(std::max(0.0, std::min(1.0, ratio)) * count);
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t cumulated = 0;
+    for (int i = 0; i < BUCKET_COUNT; ++i)
+    {
+        cumulated += buckets[i];
+        if (cumulated >= rank)
+        {
+            int64_t bound = getBucketUpperBound(i);
+            return base::Time::fromMicroseconds(std::max(min, std::min(max, bound)));
+        }
+    }
+    return getMax();
+}
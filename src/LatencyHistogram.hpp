@@ -0,0 +1,91 @@
+#ifndef AGGREGATOR_LATENCY_HISTOGRAM_HPP
+#define AGGREGATOR_LATENCY_HISTOGRAM_HPP
+
+#include <base/Time.hpp>
+#include <stdint.h>
+
+namespace aggregator
+{
+    /** Fixed-size histogram of durations with logarithmic buckets
+     *
+     * Durations are recorded in microseconds. As in HdrHistogram, each
+     * power of two is split in SUB_BUCKETS / 2 linear buckets, so that the
+     * relative error of the reported percentiles is below 2 /
+     * SUB_BUCKETS (about 6%), whatever the magnitude. Durations above
+     * 2^MAX_MAGNITUDE microseconds (about 12 days) are counted in the last
+     * bucket.
+     *
+     * Recording a value is O(1) and does not allocate.
+     */
+    class LatencyHistogram
+    {
+    public:
+        static const int SUB_BUCKET_BITS = 5;
+        static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+        static const int MAX_MAGNITUDE = 40;
+        static const int BUCKET_COUNT = SUB_BUCKETS + (MAX_MAGNITUDE - SUB_BUCKET_BITS + 1) * SUB_BUCKETS / 2;
+
+        LatencyHistogram();
+
+        /** Removes all recorded values */
+        void reset();
+
+        /** Records a duration. Negative durations are recorded as zero */
+        void record(base::Time duration)
+        {
+            recordMicroseconds(duration.toMicroseconds());
+        }
+
+        void recordMicroseconds(int64_t value);
+
+        /** Count of recorded values */
+        uint64_t getCount() const { return count; }
+        bool empty() const { return count == 0; }
+
+        base::Time getMin() const;
+        base::Time getMax() const;
+        base::Time getMean() const;
+
+        /** The duration below which the given fraction of the recorded
+         * durations are, with \c ratio in [0, 1]. It is the upper bound of
+         * the matching bucket. Null if no value has been recorded
+         */
+        base::Time getPercentile(double ratio) const;
+
+    private:
+        static int getBucketIndex(uint64_t value);
+        static uint64_t getBucketUpperBound(int index);
+
+        uint64_t buckets[BUCKET_COUNT];
+        uint64_t count;
+        int64_t min;
+        int64_t max;
+        /** sum of the recorded values, in microseconds */
+        double sum;
+    };
+
+    /** The latency histograms of a stream of the StreamAligner, see
+     * StreamAligner::setLatencyHistograms
+     */
+    struct StreamLatencyHistograms
+    {
+        /** Data time latency of the processed samples, see
+         * StreamStatus::latency */
+        LatencyHistogram latency;
+        /** Wall-clock time the processed samples spent in the stream
+         * aligner, between being pushed and being processed */
+        LatencyHistogram buffering;
+        /** Wall-clock time spent processing a sample, which is mostly the
+         * time spent in the stream's callback */
+        LatencyHistogram callback;
+
+        void reset()
+        {
+            latency.reset();
+            buffering.reset();
+            callback.reset();
+        }
+    };
+}
+
+#endif
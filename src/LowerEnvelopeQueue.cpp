@@ -0,0 +1,166 @@
+#include "LowerEnvelopeQueue.hpp"
+#include <stdexcept>
+
+using namespace aggregator;
+
+LowerEnvelopeQueue::LowerEnvelopeQueue()
+    : front_hull_size(0)
+{
+}
+
+void LowerEnvelopeQueue::clear()
+{
+    back_lines.clear();
+    back_hull.clear();
+    front_lines.clear();
+    front_hull.clear();
+    front_hull_size = 0;
+    front_history.clear();
+}
+
+bool LowerEnvelopeQueue::isRedundant(const Line &l1, const Line &l2, const Line &l3)
+{
+    // With b1 > b2 > b3, l2 is not part of the envelope if the intersection
+    // of l1 and l3 is left of the intersection of l1 and l2
+    return (l3.a - l1.a) * (l1.b - l2.b) <= (l2.a - l1.a) * (l1.b - l3.b);
+}
+
+size_t LowerEnvelopeQueue::findMinimum(const std::vector<Line> &hull, size_t size, double x)
+{
+    size_t low = 0, high = size - 1;
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        if (hull[mid + 1].at(x) <= hull[mid].at(x))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+void LowerEnvelopeQueue::push(double a, double b, int64_t id)
+{
+    Line line = { a, b, id };
+    back_lines.push_back(line);
+    while (back_hull.size() >= 2 && isRedundant(back_hull[back_hull.size() - 2], back_hull.back(), line))
+        back_hull.pop_back();
+    back_hull.push_back(line);
+}
+
+void LowerEnvelopeQueue::pushFront(const Line &line)
+{
+    Line negated = { line.a, -line.b, line.id };
+
+    // Find how many lines of the envelope are kept, the removed lines being
+    // a suffix of the envelope. They are only overwritten, so that the
+    // insertion can be undone.
+    size_t low = front_hull_size ? 1 : 0, high = front_hull_size;
+    while (low < high)
+    {
+        size_t mid = (low + high + 1) / 2;
+        if (mid < 2 || !isRedundant(front_hull[mid - 2], front_hull[mid - 1], negated))
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    Undo undo;
+    undo.position = low;
+    undo.size = front_hull_size;
+    if (low < front_hull.size())
+    {
+        undo.replaced = front_hull[low];
+        front_hull[low] = negated;
+    }
+    else
+    {
+        undo.replaced = negated;
+        front_hull.push_back(negated);
+    }
+    front_hull_size = low + 1;
+    front_history.push_back(undo);
+    front_lines.push_back(line);
+}
+
+const LowerEnvelopeQueue::Line &LowerEnvelopeQueue::front() const
+{
+    if (!front_lines.empty())
+        return front_lines.back();
+    else if (!back_lines.empty())
+        return back_lines.front();
+    throw std::logic_error("LowerEnvelopeQueue::front() called on an empty queue");
+}
+
+void LowerEnvelopeQueue::pop()
+{
+    if (front_lines.empty())
+    {
+        for (size_t i = back_lines.size(); i > 0; --i)
+            pushFront(back_lines[i - 1]);
+        back_lines.clear();
+        back_hull.clear();
+        if (front_lines.empty())
+            throw std::logic_error("LowerEnvelopeQueue::pop() called on an empty queue");
+    }
+
+    const Undo &undo = front_history.back();
+    front_hull[undo.position] = undo.replaced;
+    front_hull_size = undo.size;
+    front_history.pop_back();
+    front_lines.pop_back();
+}
+
+LowerEnvelopeQueue::Line LowerEnvelopeQueue::getMinimum(double x) const
+{
+    if (empty())
+        throw std::logic_error("LowerEnvelopeQueue::getMinimum() called on an empty queue");
+
+    Line result;
+    bool has_result = false;
+    if (front_hull_size)
+    {
+        const Line &negated = front_hull[findMinimum(front_hull, front_hull_size, -x)];
+        Line line = { negated.a, -negated.b, negated.id };
+        result = line;
+        has_result = true;
+    }
+    if (!back_hull.empty())
+    {
+        // the lines in the back stack are newer, so they win on ties
+        const Line &line = back_hull[findMinimum(back_hull, back_hull.size(), x)];
+        if (!has_result || line.at(x) <= result.at(x))
+            result = line;
+    }
+    return result;
+}
+
+void LowerEnvelopeQueue::getMinima(const std::vector<Line> &hull, size_t size, double x, double max_value, bool negated, std::vector<Line> &result)
+{
+    if (!size)
+        return;
+
+    // The values along the envelope increase on both sides of the minimum
+    size_t min_index = findMinimum(hull, size, x);
+    size_t begin = min_index, end = min_index + 1;
+    while (begin > 0 && hull[begin - 1].at(x) <= max_value)
+        --begin;
+    while (end < size && hull[end].at(x) <= max_value)
+        ++end;
+
+    for (size_t i = begin; i < end; ++i)
+    {
+        if (hull[i].at(x) <= max_value)
+        {
+            Line line = { hull[i].a, negated ? -hull[i].b : hull[i].b, hull[i].id };
+            result.push_back(line);
+        }
+    }
+}
+
+void LowerEnvelopeQueue::getMinima(double x, double tolerance, std::vector<Line> &result) const
+{
+    double max_value = getMinimum(x).at(x) + tolerance;
+    getMinima(front_hull, front_hull_size, -x, max_value, true, result);
+    getMinima(back_hull, back_hull.size(), x, max_value, false, result);
+}
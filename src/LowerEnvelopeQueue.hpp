@@ -0,0 +1,91 @@
+#ifndef AGGREGATOR_LOWER_ENVELOPE_QUEUE_HPP
+#define AGGREGATOR_LOWER_ENVELOPE_QUEUE_HPP
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace aggregator
+{
+    /** FIFO of lines y = a + b * x that gives the line with the lowest
+     * value at any given x
+     *
+     * Lines must be pushed with strictly decreasing slopes. The queue is
+     * made of two stacks, each with its own lower envelope (convex hull
+     * trick). The envelope of the front stack can be rolled back, so that
+     * push() and pop() are amortized O(log n) and getMinimum() is O(log n).
+     */
+    class LowerEnvelopeQueue
+    {
+    public:
+        struct Line
+        {
+            double a;
+            double b;
+            /** user-provided identifier of the line */
+            int64_t id;
+
+            double at(double x) const { return a + b * x; }
+        };
+
+        LowerEnvelopeQueue();
+
+        void clear();
+        bool empty() const { return front_lines.empty() && back_lines.empty(); }
+        size_t size() const { return front_lines.size() + back_lines.size(); }
+
+        /** Adds a line. Its slope must be lower than the slope of all the
+         * lines in the queue */
+        void push(double a, double b, int64_t id);
+
+        /** The oldest line in the queue */
+        const Line &front() const;
+
+        /** Removes the oldest line of the queue */
+        void pop();
+
+        /** The line with the lowest value at \c x. If several lines have
+         * the same value, the newest one is returned. The queue must not be
+         * empty
+         */
+        Line getMinimum(double x) const;
+
+        /** Appends to \c result the lines of the envelope whose value at
+         * \c x is at most \c tolerance above the minimum. This allows to
+         * break ties between lines that are equal up to rounding errors
+         */
+        void getMinima(double x, double tolerance, std::vector<Line> &result) const;
+
+    private:
+        struct Undo
+        {
+            size_t position;
+            Line replaced;
+            size_t size;
+        };
+
+        static bool isRedundant(const Line &l1, const Line &l2, const Line &l3);
+        static size_t findMinimum(const std::vector<Line> &hull, size_t size, double x);
+        static void getMinima(const std::vector<Line> &hull, size_t size, double x, double max_value, bool negated, std::vector<Line> &result);
+        void pushFront(const Line &line);
+
+        /** the lines pushed since the front stack got last filled, oldest
+         * first */
+        std::vector<Line> back_lines;
+        /** the lower envelope of back_lines */
+        std::vector<Line> back_hull;
+
+        /** the oldest lines, newest first */
+        std::vector<Line> front_lines;
+        /** the lower envelope of front_lines, with the slopes negated so
+         * that they are decreasing. Its first front_hull_size elements are
+         * valid */
+        std::vector<Line> front_hull;
+        size_t front_hull_size;
+        /** the changes to front_hull done by each element of front_lines,
+         * to undo them on pop() */
+        std::vector<Undo> front_history;
+    };
+}
+
+#endif
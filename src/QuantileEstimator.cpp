@@ -0,0 +1,125 @@
+#include "QuantileEstimator.hpp"
+#include <algorithm>
+#include <cmath>
+#include <base/Float.hpp>
+
+using namespace aggregator;
+
+QuantileEstimator::QuantileEstimator(double quantile)
+{
+    reset(quantile);
+}
+
+void QuantileEstimator::reset(double quantile)
+{
+    this->quantile = quantile;
+    reset();
+}
+
+void QuantileEstimator::reset()
+{
+    count = 0;
+    for (int i = 0; i < 5; ++i)
+    {
+        heights[i] = 0;
+        positions[i] = i + 1;
+    }
+
+    desired[0] = 1;
+    desired[1] = 1 + 2 * quantile;
+    desired[2] = 1 + 4 * quantile;
+    desired[3] = 3 + 2 * quantile;
+    desired[4] = 5;
+
+    increments[0] = 0;
+    increments[1] = quantile / 2;
+    increments[2] = quantile;
+    increments[3] = (1 + quantile) / 2;
+    increments[4] = 1;
+}
+
+void QuantileEstimator::update(double value)
+{
+    // The first five observations initialize the markers
+    if (count < 5)
+    {
+        heights[count++] = value;
+        if (count == 5)
+            std::sort(heights, heights + 5);
+        return;
+    }
+    ++count;
+
+    // Find the cell k such that heights[k] <= value < heights[k + 1],
+    // extending the extreme markers if needed
+    int k;
+    if (value < heights[0])
+    {
+        heights[0] = value;
+        k = 0;
+    }
+    else if (value >= heights[4])
+    {
+        heights[4] = value;
+        k = 3;
+    }
+    else
+    {
+        k = 0;
+        while (value >= heights[k + 1])
+            ++k;
+    }
+
+    for (int i = k + 1; i < 5; ++i)
+        positions[i]++;
+    for (int i = 0; i < 5; ++i)
+        desired[i] += increments[i];
+
+    // Adjust the heights of the middle markers if they are off their desired
+    // position by more than one
+    for (int i = 1; i < 4; ++i)
+    {
+        double d = desired[i] - positions[i];
+        if ((d >= 1 && positions[i + 1] - positions[i] > 1) ||
+                (d <= -1 && positions[i - 1] - positions[i] < -1))
+        {
+            int sign = d < 0 ? -1 : 1;
+            double h = parabolic(i, sign);
+            if (heights[i - 1] < h && h < heights[i + 1])
+                heights[i] = h;
+            else
+                heights[i] = linear(i, sign);
+            positions[i] += sign;
+        }
+    }
+}
+
+double QuantileEstimator::parabolic(int i, double d) const
+{
+    return heights[i] + d / (positions[i + 1] - positions[i - 1]) * (
+            (positions[i] - positions[i - 1] + d) * (heights[i + 1] - heights[i]) / (positions[i + 1] - positions[i]) +
+            (positions[i + 1] - positions[i] - d) * (heights[i] - heights[i - 1]) / (positions[i] - positions[i - 1]));
+}
+
+double QuantileEstimator::linear(int i, int d) const
+{
+    return heights[i] + d * (heights[i + d] - heights[i]) / (positions[i + d] - positions[i]);
+}
+
+double QuantileEstimator::getQuantile() const
+{
+    if (count == 0)
+        return base::unset<double>();
+    else if (count < 5)
+    {
+        // Not enough observations for the markers yet, use the sorted
+        // observations directly
+        double sorted[5];
+        std::copy(heights, heights + count, sorted);
+        std::sort(sorted, sorted + count);
+        size_t index = std::min<size_t>(count - 1, std::floor(quantile * count));
+        return sorted[index];
+    }
+    else
+        return heights[2];
+}
@@ -0,0 +1,59 @@
+#ifndef AGGREGATOR_QUANTILE_ESTIMATOR_HPP
+#define AGGREGATOR_QUANTILE_ESTIMATOR_HPP
+
+#include <stddef.h>
+
+namespace aggregator
+{
+    /** Streaming estimation of a single quantile of a distribution
+     *
+     * It implements the P² algorithm (Jain and Chlamtac, 1985), which keeps
+     * five markers whose heights are adjusted with a piecewise-parabolic
+     * interpolation. Memory usage is constant, and both update() and
+     * getQuantile() are O(1).
+     */
+    class QuantileEstimator
+    {
+    public:
+        /** Creates an estimator for the given quantile, in [0, 1] */
+        explicit QuantileEstimator(double quantile = 0.5);
+
+        /** Removes all observations */
+        void reset();
+
+        /** Removes all observations and changes the estimated quantile */
+        void reset(double quantile);
+
+        /** Adds an observation */
+        void update(double value);
+
+        /** The current estimate of the quantile. NaN if no observation has
+         * been given yet
+         */
+        double getQuantile() const;
+
+        /** The quantile this estimator is tracking */
+        double getTargetQuantile() const { return quantile; }
+
+        /** The count of observations given to update() so far */
+        size_t getCount() const { return count; }
+
+    private:
+        double parabolic(int i, double d) const;
+        double linear(int i, int d) const;
+
+        double quantile;
+        size_t count;
+
+        /** Marker heights */
+        double heights[5];
+        /** Actual marker positions */
+        int positions[5];
+        /** Desired marker positions */
+        double desired[5];
+        /** Increments of the desired marker positions */
+        double increments[5];
+    };
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef AGGREGATOR_RELAXED_COUNTER_HPP
+#define AGGREGATOR_RELAXED_COUNTER_HPP
+
+#include <atomic>
+#include <stddef.h>
+
+namespace aggregator
+{
+    /** A counter modified by a single thread, and readable from any number of
+     * other threads
+     *
+     * The accesses are atomic but relaxed: a reader gets a value the counter
+     * had recently, without ordering with respect to other memory accesses,
+     * in particular to other counters. As there is a single writer, the
+     * increment is a relaxed load and store, which costs the same as a
+     * non-atomic increment.
+     */
+    class RelaxedCounter
+    {
+    public:
+        RelaxedCounter()
+            : value(0) {}
+
+        /** Copies the current value of \c other. Writer side */
+        RelaxedCounter(const RelaxedCounter &other)
+            : value(other.get()) {}
+
+        /** Sets the current value of \c other. Writer side */
+        RelaxedCounter &operator=(const RelaxedCounter &other)
+        {
+            set(other.get());
+            return *this;
+        }
+
+        /** Adds one to the counter. Writer side */
+        void increment()
+        {
+            value.store(value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        /** Writer side */
+        void set(size_t new_value)
+        {
+            value.store(new_value, std::memory_order_relaxed);
+        }
+
+        /** Reader side */
+        size_t get() const
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<size_t> value;
+    };
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef AGGREGATOR_SEQ_LOCK_HPP
+#define AGGREGATOR_SEQ_LOCK_HPP
+
+#include <atomic>
+#include <cstring>
+#include <stdint.h>
+#include <type_traits>
+
+namespace aggregator
+{
+    /** Exchange of a value between one writer and any number of reader
+     * threads (sequence lock)
+     *
+     * The writer never waits. A reader retries if the value got written
+     * while it was copying it, so that it always gets a complete value.
+     * Compared to TripleBuffer, it allows several readers, and read() does
+     * not modify the object.
+     *
+     * T must be trivially copyable, as it is copied bytewise. The copy is
+     * done through atomic words, so that concurrent accesses are not data
+     * races.
+     */
+    template<typename T>
+    class SeqLock
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+                "SeqLock copies its value bytewise");
+
+    public:
+        SeqLock()
+            : sequence(0)
+        {
+            write(T());
+        }
+
+        /** Copies the current value of \c other. It must not be called while
+         * this object is written */
+        SeqLock(const SeqLock &other)
+            : sequence(0)
+        {
+            write(other.read());
+        }
+
+        /** Writes the current value of \c other. Writer side */
+        SeqLock &operator=(const SeqLock &other)
+        {
+            write(other.read());
+            return *this;
+        }
+
+        /** Publishes \c value. Writer side */
+        void write(const T &value)
+        {
+            uint64_t words[WORDS] = {};
+            std::memcpy(words, &value, sizeof(T));
+
+            // An odd sequence number marks a write in progress
+            uint64_t seq = sequence.load(std::memory_order_relaxed);
+            sequence.store(seq + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            for (size_t i = 0; i < WORDS; ++i)
+                data[i].store(words[i], std::memory_order_relaxed);
+            sequence.store(seq + 2, std::memory_order_release);
+        }
+
+        /** Gets the last written value. Reader side */
+        T read() const
+        {
+            uint64_t words[WORDS];
+            while (true)
+            {
+                uint64_t seq = sequence.load(std::memory_order_acquire);
+                if (seq & 1)
+                    continue;
+                for (size_t i = 0; i < WORDS; ++i)
+                    words[i] = data[i].load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sequence.load(std::memory_order_relaxed) == seq)
+                    break;
+            }
+
+            T value;
+            std::memcpy(&value, words, sizeof(T));
+            return value;
+        }
+
+    private:
+        static const size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint64_t> data[WORDS];
+    };
+}
+
+#endif
@@ -12,6 +12,14 @@
 #include <stdexcept> 
 #include <iostream>
 #include <aggregator/StreamAlignerStatus.hpp>
+#include <aggregator/WindowAggregate.hpp>
+#include <aggregator/QuantileEstimator.hpp>
+#include <aggregator/TimestampEstimator.hpp>
+#include <aggregator/Clock.hpp>
+#include <aggregator/TripleBuffer.hpp>
+#include <aggregator/RelaxedCounter.hpp>
+#include <aggregator/LatencyHistogram.hpp>
+#include <aggregator/Trace.hpp>
 
 namespace aggregator {
 
@@ -21,27 +29,136 @@ namespace aggregator {
 	{
 	    friend class StreamAligner;
 	    public:
-		StreamBase() : active( true ) {}
-		virtual ~StreamBase() {}
+		StreamBase() : index( -1 ), active( true ), stalled( false ), reorder_samples( 0 ), period_estimator( 0 ) {}
+		virtual ~StreamBase() { delete period_estimator; }
 		virtual base::Time pop() = 0;
 		virtual bool hasData() const = 0;
 		virtual int getPriority() const = 0;
 		virtual base::Time latestTimeStamp() const = 0;
 		virtual base::Time latestDataTime() const = 0;
 		virtual base::Time earliestDataTime() const = 0;
+		/** the wall-clock time at which the first sample in the stream
+		 * got pushed. Null if the stream is empty or arrival times are
+		 * not recorded */
+		virtual base::Time earliestArrivalTime() const = 0;
+		/** the period used to compute the lookahead of the stream */
+		virtual base::Time getPeriod() const = 0;
+		/** true if the first sample in the stream can't be preceded
+		 * anymore by a sample that arrives out of order, see
+		 * setReorderTolerance() */
+		virtual bool isSettled() const = 0;
+		/** the lowest time a sample of this stream can still be replayed
+		 * with, given its buffered samples, lookahead and reorder
+		 * tolerance. Null if there is no such bound */
+		virtual base::Time getWatermark() const = 0;
 		virtual const StreamStatus &getBufferStatus() const = 0;
 		virtual void copyState( const StreamBase& other ) = 0;
 		virtual void clear() = 0;
 
 		bool isActive() const { return active; }
 		void setActive( bool active ) { this->active = active; }
+
+		/** true if the stream got deactivated by the stall detection */
+		bool isStalled() const { return stalled; }
+
+		/** deactivates the stream because it did not receive data for
+		 * too long */
+		void stall()
+		{
+		    setActive( false );
+		    stalled = true;
+		    counters.stall_count.increment();
+		}
+
+		/** reactivates a stalled stream on reception of a sample at ts.
+		 * The stall duration is not known if the stream got cleared
+		 * meanwhile */
+		void recover( base::Time ts )
+		{
+		    stalled = false;
+		    if( latestDataTime().isNull() )
+			return;
+		    status.last_stall_duration = ts - latestDataTime();
+		    status.total_stall_duration = status.total_stall_duration + status.last_stall_duration;
+		}
+
+		const WindowAggregate &getWindowAggregate() const { return aggregate; }
+
+		/** the maximum time the aligner waits for this stream. Null if
+		 * the aligner's timeout should be used */
+		base::Time getTimeout() const { return timeout; }
+		void setTimeout( base::Time timeout ) { this->timeout = timeout; }
+
+		void setReorderTolerance( base::Time time, size_t samples )
+		{
+		    reorder_time = time;
+		    reorder_samples = samples;
+		}
+
+		void enablePeriodEstimation( base::Time window, base::Time initial_period )
+		{
+		    delete period_estimator;
+		    period_estimator = new TimestampEstimator( window, initial_period );
+		}
 		
 		friend std::ostream &operator<<(std::ostream &stream, const aggregator::StreamAligner::StreamBase &base);
 		
+		/** the current values of the counters */
+		StreamCounters readCounters() const
+		{
+		    StreamCounters result;
+		    result.samples_received = counters.samples_received.get();
+		    result.samples_processed = counters.samples_processed.get();
+		    result.samples_dropped_buffer_full = counters.samples_dropped_buffer_full.get();
+		    result.samples_dropped_late_arriving = counters.samples_dropped_late_arriving.get();
+		    result.samples_backward_in_time = counters.samples_backward_in_time.get();
+		    result.samples_reordered = counters.samples_reordered.get();
+		    result.stall_count = counters.stall_count.get();
+		    return result;
+		}
+
 	    protected:
 		mutable StreamStatus status;
+		/** the counters of the stream, kept out of the status so that
+		 * they can be read from other threads, see
+		 * StreamAligner::readStreamCounters */
+		struct Counters
+		{
+		    RelaxedCounter samples_received;
+		    RelaxedCounter samples_processed;
+		    RelaxedCounter samples_dropped_buffer_full;
+		    RelaxedCounter samples_dropped_late_arriving;
+		    RelaxedCounter samples_backward_in_time;
+		    RelaxedCounter samples_reordered;
+		    RelaxedCounter stall_count;
+		} counters;
+		/** index of the stream in the aligner, used in traces */
+		int index;
 		/** marks a stream as active or inactive. All streams are active by default. */
 		bool active;
+		/** marks a stream that got deactivated by the stall detection */
+		bool stalled;
+		/** per-stream override of the aligner's timeout, or null */
+		base::Time timeout;
+		/** arrival delays of the samples, i.e. the difference between the
+		 * time at which they got pushed and their timestamp. Only
+		 * updated in adaptive timeout mode */
+		QuantileEstimator arrival_delay;
+		/** window aggregates of the samples that went out of this stream */
+		WindowAggregate aggregate;
+		/** maximum age, relative to the newest sample, of a sample that
+		 * arrives out of order and still gets inserted in the stream */
+		base::Time reorder_time;
+		/** maximum count of buffered samples an out of order sample can be
+		 * inserted before */
+		size_t reorder_samples;
+		/** estimates the period of the stream from the incoming
+		 * timestamps, if period estimation is enabled. Null otherwise */
+		TimestampEstimator *period_estimator;
+		/** latency histograms, only updated if enabled with
+		 * setLatencyHistograms. They are kept out of the status, which
+		 * only gets their percentiles */
+		StreamLatencyHistograms histograms;
 	};
 
         public:
@@ -49,12 +166,31 @@ namespace aggregator {
 	{
 	public:
 	    typedef boost::function<void (const base::Time &ts, const T &value)> callback_t;
+	    /** extracts the scalar fields of a sample that should be aggregated
+	     * by the stream's window aggregate */
+	    typedef boost::function<void (const T &value, std::vector<double> &fields)> extractor_t;
 
 	protected:
 	    typedef std::pair<base::Time,T> item;
-	    boost::circular_buffer<item> buffer;
+
+	    /** a buffered sample along with the wall-clock time it got pushed
+	     * at */
+	    struct entry
+	    {
+		base::Time time;
+		base::Time arrival_time;
+		T data;
+
+		entry( const base::Time &time, const base::Time &arrival_time, const T &data )
+		    : time( time ), arrival_time( arrival_time ), data( data ) {}
+	    };
+
+	    boost::circular_buffer<entry> buffer;
 	    size_t bufferSize;
 	    callback_t callback;
+	    callback_t late_callback;
+	    extractor_t extractor;
+	    std::vector<double> fields;
 	    base::Time period; 
 	    base::Time lastTime;
 	    int priority;
@@ -83,7 +219,7 @@ namespace aggregator {
 		if(buffer.empty())
 		    return false;
 		
-		sample = buffer.front();
+		sample = item( buffer.front().time, buffer.front().data );
 		return true;
 	    }
 
@@ -98,6 +234,16 @@ namespace aggregator {
 		status.latest_data_time = latestDataTime();
  		status.earliest_data_time = earliestDataTime();
 		status.active = isActive();
+		status.period = getPeriod();
+
+		StreamCounters current = readCounters();
+		status.samples_received = current.samples_received;
+		status.samples_processed = current.samples_processed;
+		status.samples_dropped_buffer_full = current.samples_dropped_buffer_full;
+		status.samples_dropped_late_arriving = current.samples_dropped_late_arriving;
+		status.samples_backward_in_time = current.samples_backward_in_time;
+		status.samples_reordered = current.samples_reordered;
+		status.stall_count = current.stall_count;
 		return status;
 	    }
 
@@ -109,25 +255,116 @@ namespace aggregator {
 		buffer = stream.buffer;
 		bufferSize = stream.bufferSize;
 		status = stream.status; 
+		counters = stream.counters;
+		aggregate = stream.aggregate;
+		arrival_delay = stream.arrival_delay;
+		if( period_estimator && stream.period_estimator )
+		    *period_estimator = *stream.period_estimator;
+	    }
+
+	    void setLateCallback( callback_t late_callback )
+	    {
+		this->late_callback = late_callback;
+	    }
+
+	    /** hands a sample that arrived too late to be replayed to the late
+	     * callback, if there is one
+	     */
+	    void pushLate(const base::Time &ts, const T &data )
+	    {
+		if(late_callback)
+		    late_callback( ts, data );
 	    }
 
-	    void push(const base::Time &ts, const T &data ) 
+	    void setWindowAggregate( base::Time window, size_t dimension, extractor_t extractor )
+	    {
+		this->extractor = extractor;
+		fields.resize( dimension );
+		aggregate.reset( window, dimension );
+	    }
+
+	    void push(const base::Time &ts, const base::Time &arrival_time, const T &data ) 
 	    { 
 		if(ts < lastTime)
 		{
-		    status.samples_backward_in_time++;
+		    insert(ts, arrival_time, data);
 		    return;
 		}
 		
 		lastTime = ts;
+		if( period_estimator )
+		    period_estimator->update( ts );
+
+		reserve();
+                buffer.push_back( entry(ts, arrival_time, data) ); 
+	    }
 
+	    /** insert a sample that arrived out of order at its sorted position,
+	     * if it is within the reorder tolerance of the stream. It gets
+	     * dropped otherwise.
+	     *
+	     * The sample inherits the arrival time of the sample it gets
+	     * inserted before if that one is older, as it has to be replayed
+	     * first. Arrival times are therefore ordered in the buffer.
+	     */
+	    void insert(const base::Time &ts, base::Time arrival_time, const T &data )
+	    {
+		if( (reorder_time.isNull() && !reorder_samples) ||
+			(!reorder_time.isNull() && lastTime - ts > reorder_time) ||
+			(reorder_samples && buffer.empty()) )
+		{
+		    AGGREGATOR_TRACE_INSTANT( "drop_backward", index );
+		    counters.samples_backward_in_time.increment();
+		    return;
+		}
+
+		// the search is bounded by the reorder tolerance, since all the
+		// samples we go over are newer than ts
+		typename boost::circular_buffer<entry>::iterator pos = buffer.end();
+		size_t displacement = 0;
+		while( pos != buffer.begin() && ts < (pos - 1)->time )
+		{
+		    if( reorder_samples && displacement == reorder_samples )
+		    {
+			AGGREGATOR_TRACE_INSTANT( "drop_backward", index );
+			counters.samples_backward_in_time.increment();
+			return;
+		    }
+		    --pos;
+		    ++displacement;
+		}
+
+		if( buffer.full() && bufferSize > 0 && pos == buffer.begin() )
+		{
+		    // inserting at the front of a full buffer is a no-op
+		    AGGREGATOR_TRACE_INSTANT( "drop_buffer_full", index );
+		    counters.samples_dropped_buffer_full.increment();
+		    return;
+		}
+
+		// a full fixed-size buffer drops its oldest sample on insertion
+		size_t index = pos - buffer.begin();
+		if( pos != buffer.end() && pos->arrival_time < arrival_time )
+		    arrival_time = pos->arrival_time;
+		reserve();
+		buffer.insert( buffer.begin() + index, entry(ts, arrival_time, data) );
+		counters.samples_reordered.increment();
+	    }
+
+	    /** makes sure that there is room for one more sample in the buffer,
+	     * or accounts for the oldest sample being dropped if the buffer has a
+	     * fixed size
+	     */
+	    void reserve()
+	    {
 		if (buffer.full())
                 {
 		    if (bufferSize > 0)
 		    {
 		        // if the buffer is full, just use the behaviour of the circular
 		        // buffer: discard old data.
-		        status.samples_dropped_buffer_full++;
+		        AGGREGATOR_TRACE_INSTANT( "drop_buffer_full", index );
+		        counters.samples_dropped_buffer_full.increment();
 		    }
 		    else
 		    {
@@ -135,7 +372,6 @@ namespace aggregator {
 			status.buffer_size = buffer.capacity();
 		    }
 		}
-                buffer.push_back( std::make_pair(ts, data) ); 
 	    }
 
 	    /** take the last item of the stream queue and 
@@ -145,10 +381,15 @@ namespace aggregator {
 	    { 
 		if( hasData() )
 		{
-		    status.samples_processed++;
-		    base::Time ts = buffer.front().first;
+		    counters.samples_processed.increment();
+		    base::Time ts = buffer.front().time;
+		    if(extractor)
+		    {
+			extractor( buffer.front().data, fields );
+			aggregate.push( ts, fields );
+		    }
 		    if(callback)
-			callback( ts, buffer.front().second );
+			callback( ts, buffer.front().data );
 		    buffer.pop_front();
 		    return ts;
 		}
@@ -162,10 +403,47 @@ namespace aggregator {
 	    base::Time latestTimeStamp() const
 	    {
 		if( hasData() )
-		    return buffer.front().first;
+		    return buffer.front().time;
+		else if( !reorder_time.isNull() )
+		    return lastTime - reorder_time;
+		else if( period_estimator && period_estimator->haveEstimate() )
+		    return period_estimator->expectedArrival();
 		else 
 		    return lastTime + period;
 	    }
+
+	    virtual base::Time getWatermark() const
+	    {
+		// a disabled stream gets enabled by any new sample
+		if( !isActive() && !hasData() )
+		    return base::Time();
+		// the sample could be inserted anywhere in the buffer
+		if( reorder_samples && buffer.size() <= reorder_samples )
+		    return base::Time();
+
+		base::Time result = latestTimeStamp();
+		if( hasData() && !reorder_time.isNull() && lastTime - reorder_time < result )
+		    result = lastTime - reorder_time;
+		return result;
+	    }
+
+	    virtual base::Time getPeriod() const
+	    {
+		if( period_estimator && period_estimator->haveEstimate() )
+		    return period_estimator->getPeriod();
+		return period;
+	    }
+
+	    virtual bool isSettled() const
+	    {
+		if( !hasData() )
+		    return false;
+		if( !reorder_time.isNull() && buffer.front().time > lastTime - reorder_time )
+		    return false;
+		if( reorder_samples && buffer.size() <= reorder_samples )
+		    return false;
+		return true;
+	    }
 	    
 	    virtual base::Time latestDataTime() const
 	    {
@@ -175,7 +453,14 @@ namespace aggregator {
 	    virtual base::Time earliestDataTime() const
 	    {
 		if( hasData() )
-		    return buffer.front().first;
+		    return buffer.front().time;
+		return base::Time();
+	    }
+
+	    virtual base::Time earliestArrivalTime() const
+	    {
+		if( hasData() )
+		    return buffer.front().arrival_time;
 		return base::Time();
 	    }
 	    
@@ -183,11 +468,20 @@ namespace aggregator {
 	    {	
 		lastTime = base::Time();
 		buffer.clear();
+		aggregate.clear();
+		arrival_delay.reset();
+		if( period_estimator )
+		    period_estimator->reset();
+
+		// the stall detection deactivated the stream, not the user
+		if( stalled )
+		    setActive( true );
+		stalled = false;
 		
 		status.latest_sample_time = base::Time();
 		status.latest_data_time = base::Time();
-		status.samples_dropped_buffer_full = 0;
-		status.samples_dropped_late_arriving = 0;
+		counters.samples_dropped_buffer_full.set( 0 );
+		counters.samples_dropped_late_arriving.set( 0 );
 		status.buffer_fill = 0;
 		status.active = true;
 	    };
@@ -218,6 +512,84 @@ namespace aggregator {
 	    return ts1 < ts2;
 	}
 
+	/** the timeout that applies to the given stream */
+	base::Time getEffectiveTimeout( const StreamBase &stream ) const
+	{
+	    base::Time result = stream.getTimeout();
+	    if( result.isNull() )
+		result = timeout;
+
+	    if( adaptive_timeout_quantile > 0 && stream.arrival_delay.getCount() >= ADAPTIVE_TIMEOUT_MIN_SAMPLES )
+	    {
+		base::Time adaptive = base::Time::fromSeconds( 
+			std::max( 0.0, stream.arrival_delay.getQuantile() ) ) + adaptive_timeout_margin;
+		if( adaptive < result )
+		    result = adaptive;
+	    }
+	    return result;
+	}
+
+	/** true if the given stream received no data for more than
+	 * stall_periods of its period */
+	bool isStalling( const StreamBase &stream ) const
+	{
+	    if( !stall_periods || stream.latestDataTime().isNull() )
+		return false;
+
+	    base::Time period = stream.getPeriod();
+	    if( period <= base::Time() )
+		return false;
+
+	    return latest_ts - stream.latestDataTime() > period * stall_periods;
+	}
+
+	/** replays the next sample of the given stream, and updates the
+	 * aligner's time accordingly */
+	void popStream( StreamBase *stream )
+	{
+	    AGGREGATOR_TRACE_BEGIN( "pop", stream->index );
+	    if( !latency_histograms )
+	    {
+		current_ts = stream->pop();
+		stream->status.latency = latest_ts - current_ts;
+		AGGREGATOR_TRACE_END( "pop", stream->index );
+		return;
+	    }
+
+	    base::Time arrival_time = stream->earliestArrivalTime();
+	    base::Time start = clock->now();
+	    current_ts = stream->pop();
+	    base::Time end = clock->now();
+	    AGGREGATOR_TRACE_END( "pop", stream->index );
+	    stream->status.latency = latest_ts - current_ts;
+
+	    stream->histograms.latency.record( stream->status.latency );
+	    if( !arrival_time.isNull() )
+		stream->histograms.buffering.record( start - arrival_time );
+	    stream->histograms.callback.record( end - start );
+	}
+
+	/** summarizes a latency histogram for the StreamStatus */
+	static void getPercentiles( const LatencyHistogram &histogram, LatencyPercentiles &result )
+	{
+	    if( histogram.empty() )
+	    {
+		result = LatencyPercentiles();
+		return;
+	    }
+	    result.count = histogram.getCount();
+	    result.p50 = histogram.getPercentile( 0.5 );
+	    result.p99 = histogram.getPercentile( 0.99 );
+	    result.p999 = histogram.getPercentile( 0.999 );
+	    result.max = histogram.getMax();
+	}
+
+	/** ordering of the stream heap used in stepUntil() */
+	static bool compareStreamsReversed( const StreamBase* b1, const StreamBase* b2 )
+	{
+	    return compareStreams( b2, b1 );
+	}
+
 	typedef std::vector<StreamBase*> stream_vector;
 	stream_vector streams;
 	base::Time timeout;
@@ -228,16 +600,57 @@ namespace aggregator {
 	/** time of the last sample that went out */
 	base::Time current_ts;
 
+	typedef boost::function<void (const base::Time &watermark)> watermark_callback_t;
+	watermark_callback_t watermark_callback;
+
+	/** the last watermark given to watermark_callback */
+	base::Time published_watermark;
+
 	double buffer_size_factor;
 
+	/** quantile of the arrival delay used in adaptive timeout mode, zero
+	 * if disabled */
+	double adaptive_timeout_quantile;
+	base::Time adaptive_timeout_margin;
+
+	/** count of arrival delays that must have been recorded on a stream
+	 * before its adaptive timeout gets used */
+	static const size_t ADAPTIVE_TIMEOUT_MIN_SAMPLES = 10;
+
+	/** count of periods without data after which a stream gets
+	 * deactivated, zero if stall detection is disabled */
+	int stall_periods;
+
+	/** maximum wall-clock time a sample can stay in the aligner, null if
+	 * there is no such bound */
+	base::Time max_latency;
+
+	/** true if the latency histograms of the streams get updated */
+	bool latency_histograms;
+
+	/** source of wall-clock time */
+	ClockPtr clock;
+
 	/** temporary object that gets returned by getStatus, 
 	 * in order to avoid dynamic allocation on each call
 	 */  
 	mutable StreamAlignerStatus status;
 
+	/** status snapshots for readers in other threads, see
+	 * publishStatus() */
+	TripleBuffer<StreamAlignerStatus> published_status;
+
+	/** period at which step() publishes the status, null if it does
+	 * not */
+	base::Time status_period;
+
+	/** the time at which the status got last published by step() */
+	base::Time status_publication_time;
+
     public:
 	explicit StreamAligner(base::Time timeout = base::Time::fromSeconds(1))
-	    : timeout(timeout), buffer_size_factor(2.0) {}
+	    : timeout(timeout), buffer_size_factor(2.0), adaptive_timeout_quantile(0), stall_periods(0),
+	      latency_histograms(false), clock(Clock::getSystemClock()) {}
 
 	virtual ~StreamAligner()
 	{
@@ -278,6 +691,165 @@ namespace aggregator {
 	    timeout = t;
 	}
 
+	/** Sets the clock used by the features that depend on wall-clock time
+	 * (adaptive timeout and status generation)
+	 *
+	 * It is Clock::getSystemClock() by default. Use e.g. a SimulatedClock
+	 * to run simulations faster than real time, or a cheaper clock to
+	 * reduce the cost of the time reads.
+	 */
+	void setClock( ClockPtr clock )
+	{
+	    this->clock = clock;
+	}
+
+	ClockPtr getClock() const { return clock; }
+
+	/** Bounds the wall-clock time samples can stay in the aligner
+	 *
+	 * The timeout only compares sample timestamps, so buffered samples
+	 * stay in the aligner as long as no newer data arrives. With a maximum
+	 * latency, the streams are considered to have timed out as soon as a
+	 * buffered sample got pushed more than \c latency ago, according to
+	 * the aligner's clock. step() then replays samples until this is not
+	 * the case anymore.
+	 *
+	 * Since step() is only called by the user, this requires step() to be
+	 * called when getNextDeadline() is reached, even if no new data
+	 * arrived. Set to null to disable, which is the default.
+	 */
+	void setMaxLatency( const base::Time &latency )
+	{
+	    max_latency = latency;
+	}
+
+	base::Time getMaxLatency() const { return max_latency; }
+
+	/** Enables the latency histograms of the streams, see
+	 * getLatencyHistograms
+	 *
+	 * They record, for each processed sample, its data time latency, the
+	 * wall-clock time it spent in the aligner and the wall-clock time
+	 * spent in its callback. This costs two to three reads of the
+	 * aligner's clock per sample. Disabled by default.
+	 */
+	void setLatencyHistograms( bool enable )
+	{
+	    latency_histograms = enable;
+	}
+
+	/** Removes the samples recorded in the latency histograms of all
+	 * streams */
+	void resetHistograms()
+	{
+	    for(size_t i = 0; i < streams.size(); i++)
+	    {
+		if(streams[i])
+		    streams[i]->histograms.reset();
+	    }
+	}
+
+	/** @return the wall-clock time at which the next buffered sample
+	 * exceeds the maximum latency, and step() should be called. Null if
+	 * there is no buffered sample or no maximum latency
+	 */
+	base::Time getNextDeadline() const
+	{
+	    base::Time arrival = earliestArrivalTime();
+	    if( max_latency.isNull() || arrival.isNull() )
+		return base::Time();
+	    return arrival + max_latency;
+	}
+
+	/** Enables the adaptive timeout mode
+	 *
+	 * In this mode, the delay between the time at which each sample is
+	 * pushed (wall-clock time) and its timestamp is recorded for every
+	 * stream. The time the aligner waits for a stream is then the given
+	 * quantile of that stream's delays plus \c margin, as long as this is
+	 * lower than the stream's configured timeout.
+	 *
+	 * This requires the sample timestamps to be on the same time base than
+	 * the wall clock. Set quantile to zero to disable, which is the
+	 * default.
+	 *
+	 * @param quantile - the quantile of the arrival delay, e.g. 0.999
+	 * @param margin - added to the estimated quantile
+	 */
+	void setAdaptiveTimeout( double quantile, base::Time margin = base::Time() )
+	{
+	    adaptive_timeout_quantile = quantile;
+	    adaptive_timeout_margin = margin;
+	    for(size_t i = 0; i < streams.size(); i++)
+	    {
+		if(streams[i])
+		    streams[i]->arrival_delay.reset( quantile );
+	    }
+	}
+
+	/** Set the time the aligner will wait for an expected reading on the
+	 * given stream, overriding the value given to setTimeout().
+	 *
+	 * This allows to bound the latency added by slow streams separately
+	 * from the fast ones. Set to null to use the aligner's timeout again.
+	 */
+	void setStreamTimeout( int idx, const base::Time &t )
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+
+	    streams[idx]->setTimeout( t );
+	}
+
+	/** @return the time the aligner will wait for an expected reading on
+	 * the given stream
+	 */
+	base::Time getStreamTimeout( int idx ) const
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+
+	    return getEffectiveTimeout( *streams[idx] );
+	}
+
+	/** Allows samples that arrive out of order on the given stream to be
+	 * inserted at their sorted position instead of being dropped.
+	 *
+	 * A sample older than the newest sample of the stream is accepted if it
+	 * is at most \c time older than it (when \c time is non-null) and if it
+	 * goes before at most \c samples buffered samples (when \c samples is
+	 * non-zero). This bounds the cost of the insertion.
+	 *
+	 * The aligner will hold the samples of this stream until they can't be
+	 * preceded anymore by an out of order sample, or until the timeout is
+	 * reached. This adds up to \c time, or to \c samples periods, of
+	 * latency to the stream. Set both to zero to disable reordering, which
+	 * is the default.
+	 */
+	void setReorderTolerance( int idx, base::Time time, size_t samples = 0 )
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+
+	    streams[idx]->setReorderTolerance( time, samples );
+	}
+
+	/** Enables the detection of stalled streams
+	 *
+	 * A stream that did not receive any data for more than \c periods of
+	 * its period, while the other streams did, gets disabled as with
+	 * disableStream(). As any disabled stream, it is enabled again as
+	 * soon as new data arrives. Stalls are reported in the stream's
+	 * StreamStatus.
+	 *
+	 * Only periodic streams which received at least one sample are
+	 * considered. Set to zero to disable, which is the default.
+	 */
+	void setStallDetection( int periods )
+	{
+	    stall_periods = periods;
+	}
+
 	/** 
 	 * Will disable the stream with the given index.  
 	 *
@@ -361,11 +933,16 @@ namespace aggregator {
 	 *      one with the lower priority value will be pushed first.
 	 *
 	 * @param name - name of the stream. This is only for debug purposes
+	 *
+	 * @param streamTimeout - the maximum time the aligner will wait for
+	 *      this stream. If null, the aligner's timeout is used. See
+	 *      setStreamTimeout()
 	 * 
 	 * @result - stream index, which is used to identify the stream (e.g. for push).
 	 */
-	template <class T> int registerStream( typename Stream<T>::callback_t callback, int bufferSize, base::Time period, int priority  = -1, const std::string &name = std::string()) 
+	template <class T> int registerStream( typename Stream<T>::callback_t callback, int bufferSize, base::Time period, int priority  = -1, const std::string &name = std::string(), base::Time streamTimeout = base::Time()) 
 	{
+	    base::Time timeout = streamTimeout.isNull() ? this->timeout : streamTimeout;
 	    if( bufferSize < 0 )
 	    {
 		if( period == base::Time() )
@@ -390,18 +967,22 @@ namespace aggregator {
 	    }
 
 	    StreamBase *newStream = new Stream<T>(callback, bufferSize, period, priority, name);
+	    newStream->setTimeout( streamTimeout );
+	    newStream->arrival_delay.reset( adaptive_timeout_quantile );
 	    
 	    //check if there is a free slot from a previous deleted stream
 	    for(size_t i = 0; i < streams.size(); i++)
 	    {
 		if(!streams[i])
 		{
+		    newStream->index = i;
 		    streams[i] = newStream;
 		    status.streams[i] = StreamStatus();
 		    return i;
 		}
 	    }
 		
+	    newStream->index = streams.size();
 	    streams.push_back( newStream );
 	    status.streams.push_back(StreamStatus());
 	    return streams.size() - 1;
@@ -423,9 +1004,21 @@ namespace aggregator {
 	    Stream<T>* stream = dynamic_cast<Stream<T>*>(streams[idx]);
 	    assert( stream );
 
-	    stream->status.samples_received++;
+	    AGGREGATOR_TRACE_INSTANT( "push", idx );
+	    stream->counters.samples_received.increment();
 	    stream->status.latest_sample_time = ts;
 
+	    if( stream->isStalled() )
+		stream->recover( ts );
+
+	    // the clock is only read if a feature needs it
+	    base::Time now;
+	    if( adaptive_timeout_quantile > 0 || !max_latency.isNull() || latency_histograms )
+		now = clock->now();
+
+	    if( adaptive_timeout_quantile > 0 )
+		stream->arrival_delay.update( (now - ts).toSeconds() );
+
 	    // mark stream as active, since it is receiving data items will
 	    // have no effect on an already active stream, but enables
 	    // streams which have been marked passive before.
@@ -435,15 +1028,91 @@ namespace aggregator {
 	    //will never be played back and gets dropped by default
 	    if(ts < current_ts) 
 	    {
+		AGGREGATOR_TRACE_INSTANT( "drop_late", idx );
 		status.samples_dropped_late_arriving++;
-		stream->status.samples_dropped_late_arriving++;
+		stream->counters.samples_dropped_late_arriving.increment();
+		stream->pushLate( ts, data );
 		return;
 	    }
 
 	    if( ts > latest_ts )
 		latest_ts = ts;
 	    
-	    stream->push( ts, data );
+	    stream->push( ts, now, data );
+	}
+
+	/** Makes the given stream estimate its period from the timestamps of
+	 * the incoming samples, using a TimestampEstimator.
+	 *
+	 * Once the estimator has an estimate, the lookahead of the stream is
+	 * the expected time of its next sample (see
+	 * TimestampEstimator::expectedArrival()) instead of being based on the
+	 * period given to registerStream(). Stream latency therefore adapts
+	 * without having to tune the declared period.
+	 *
+	 * @param window - the estimation window, see TimestampEstimator
+	 * @param initial_period - the period used until the estimator has seen
+	 *      a full window. If null, the period given at registration is used
+	 */
+	void enablePeriodEstimation( int idx, base::Time window, base::Time initial_period = base::Time() )
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+
+	    if( initial_period.isNull() )
+		initial_period = streams[idx]->getPeriod();
+	    streams[idx]->enablePeriodEstimation( window, initial_period );
+	}
+
+	/** Sets a callback that receives the samples of the given stream which
+	 * arrive too late to be replayed, i.e. which are older than the
+	 * current time of the aligner.
+	 *
+	 * These samples are still counted in samples_dropped_late_arriving,
+	 * and are passed to the callback from within push(). This allows
+	 * consumers that can handle corrections to use data which would
+	 * otherwise be lost, and therefore to use a shorter timeout.
+	 */
+	template <class T> void setLateCallback( int idx, typename Stream<T>::callback_t callback )
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+
+	    Stream<T>* stream = dynamic_cast<Stream<T>*>(streams[idx]);
+	    assert( stream );
+
+	    stream->setLateCallback( callback );
+	}
+
+	/** Enables the computation of window aggregates on the given stream
+	 *
+	 * The aggregates are updated for every sample that goes out of the
+	 * stream, before its callback is called, so the callback can query
+	 * them through getWindowAggregate().
+	 *
+	 * @param window - length of the window in data time
+	 * @param extractor - fills the fields vector, which has \c dimension
+	 *      elements, with the values that should be aggregated
+	 * @param dimension - number of scalar fields extracted from each sample
+	 */
+	template <class T> void setWindowAggregate( int idx, base::Time window, typename Stream<T>::extractor_t extractor, size_t dimension = 1 )
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+
+	    Stream<T>* stream = dynamic_cast<Stream<T>*>(streams[idx]);
+	    assert( stream );
+
+	    stream->setWindowAggregate( window, dimension, extractor );
+	}
+
+	/** @return the window aggregates of the given stream */
+	const WindowAggregate &getWindowAggregate( int idx ) const
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+
+	    return streams[idx]->getWindowAggregate();
 	}
 
 	template <class T> bool getNextSample( int idx, std::pair<base::Time,T> &sample) const
@@ -471,13 +1140,128 @@ namespace aggregator {
 	 *    case, the oldest data (which is obviously non-available) is ignored,
 	 *    and only newer data is considered.
 	 *
+	 *  The watermark is published to the watermark callback, if there is
+	 *  one, after each call.
+	 *
 	 *  @result - true if a callback was called and more data might be available 
 	 */
 	bool step()
+	{
+	    bool result = stepInternal();
+	    publishWatermark();
+	    publishPeriodicStatus();
+	    return result;
+	}
+
+	/** Replays all buffered samples with a timestamp lower or equal to
+	 * \c time, in order, and advances the aligner's time to \c time.
+	 *
+	 * All streams are considered to have timed out up to \c time, i.e.
+	 * samples that get pushed afterwards with a timestamp lower than \c
+	 * time will be dropped as late arrivals. This is meant for lockstep
+	 * simulation and batch processing, where it replaces calling step()
+	 * until getCurrentTime() reaches the target time. The streams are
+	 * merged in a single pass.
+	 *
+	 * getLatestTime() is left unchanged, as no sample got received at \c
+	 * time. getLatency() is therefore negative until a sample newer than
+	 * \c time gets pushed.
+	 *
+	 * @result - the number of samples replayed
+	 */
+	size_t stepUntil( const base::Time &time )
+	{
+	    // heap of the streams that have samples to replay, the stream with
+	    // the next sample being on top
+	    stream_vector heap;
+	    for(size_t i = 0; i < streams.size(); i++)
+	    {
+		if(streams[i] && streams[i]->hasData() && streams[i]->earliestDataTime() <= time)
+		    heap.push_back( streams[i] );
+	    }
+	    std::make_heap( heap.begin(), heap.end(), &compareStreamsReversed );
+
+	    size_t count = 0;
+	    while( !heap.empty() )
+	    {
+		std::pop_heap( heap.begin(), heap.end(), &compareStreamsReversed );
+		StreamBase *stream = heap.back();
+		popStream( stream );
+		count++;
+
+		if( stream->hasData() && stream->earliestDataTime() <= time )
+		    std::push_heap( heap.begin(), heap.end(), &compareStreamsReversed );
+		else
+		    heap.pop_back();
+	    }
+
+	    if( current_ts < time )
+		current_ts = time;
+
+	    publishWatermark();
+	    publishPeriodicStatus();
+	    return count;
+	}
+
+    protected:
+	/** calls the watermark callback if the watermark advanced since the
+	 * last call */
+	void publishWatermark()
+	{
+	    if( !watermark_callback )
+		return;
+
+	    base::Time watermark = getWatermark();
+	    if( watermark > published_watermark )
+	    {
+		published_watermark = watermark;
+		watermark_callback( watermark );
+	    }
+	}
+
+	/** publishes the status if the status publication period elapsed
+	 * since the last publication */
+	void publishPeriodicStatus()
+	{
+	    if( status_period.isNull() )
+		return;
+
+	    base::Time now = clock->now();
+	    if( now - status_publication_time >= status_period )
+	    {
+		status_publication_time = now;
+		publishStatus();
+	    }
+	}
+
+	/** @return the arrival time of the oldest buffered sample, null if
+	 * there is none */
+	base::Time earliestArrivalTime() const
+	{
+	    base::Time result;
+	    for(size_t i = 0; i < streams.size(); i++)
+	    {
+		if(!streams[i])
+		    continue;
+
+		base::Time arrival = streams[i]->earliestArrivalTime();
+		if( !arrival.isNull() && (result.isNull() || arrival < result) )
+		    result = arrival;
+	    }
+	    return result;
+	}
+
+	/** implementation of step() */
+	bool stepInternal()
 	{
 	    if( streams.empty() )
 		return false;
 
+	    // a buffered sample exceeded the maximum latency, so all streams
+	    // are considered to have timed out
+	    base::Time deadline = getNextDeadline();
+	    bool expired = !deadline.isNull() && clock->now() >= deadline;
+
 	    // copy streams vector and sort it by next ts
 	    stream_vector items = streams;
 	    std::sort( items.begin(), items.end(), &compareStreams );
@@ -488,14 +1272,22 @@ namespace aggregator {
 		if(!*it)
 		    return false;
 		
-		if( (*it)->hasData() ) 
+		if( (*it)->hasData() && (!(*it)->isActive() || (*it)->isSettled()) ) 
 		{
 		    // if stream has current data, pop that data
-		    current_ts = (*it)->pop();
+		    popStream( *it );
 		    return true;
 		}
 		else if( (*it)->isActive() )
 		{
+		    if( !(*it)->hasData() && isStalling( **it ) )
+		    {
+			// the stream is considered dead, do not let it add
+			// latency to the other streams anymore
+			AGGREGATOR_TRACE_INSTANT( "stall", (*it)->index );
+			(*it)->stall();
+			continue;
+		    }
 
 		    base::Time latestDataTime;
 		    base::Time firstDataTime;
@@ -521,17 +1313,69 @@ namespace aggregator {
 			firstDataTime = current_ts;
 		    }
 
-		    if(latestDataTime - firstDataTime < timeout)
+		    if(!expired && latestDataTime - firstDataTime < getEffectiveTimeout( **it ))
 		    {
 			// if there is no data, but the expected data has
 			// not run out yet, wait for it.
+			AGGREGATOR_TRACE_INSTANT( "wait", (*it)->index );
 			return false;
 		    }
+
+		    AGGREGATOR_TRACE_INSTANT( "timeout", (*it)->index );
+
+		    if( (*it)->hasData() )
+		    {
+			// the stream is still waiting for samples that might
+			// come out of order, but timed out
+			popStream( *it );
+			return true;
+		    }
 		}
 	    }
 	    return false;
 	}
 
+    public:
+	/** Returns the aligner's watermark
+	 *
+	 * No sample with a timestamp lower than the watermark will be replayed
+	 * anymore. It is derived from the time of the last replayed sample,
+	 * from the next samples in the streams and from the stream's
+	 * lookahead. It relies on the periodic streams respecting their
+	 * period.
+	 *
+	 * Downstream processing can use this to finalize results for data up
+	 * to the watermark without having to wait for their own timeouts.
+	 */
+	base::Time getWatermark() const
+	{
+	    base::Time watermark;
+	    bool bounded = true;
+	    for(size_t i = 0; i < streams.size() && bounded; i++)
+	    {
+		if(!streams[i])
+		    continue;
+
+		base::Time bound = streams[i]->getWatermark();
+		if( bound.isNull() )
+		    bounded = false;
+		else if( watermark.isNull() || bound < watermark )
+		    watermark = bound;
+	    }
+
+	    if( !bounded || watermark < current_ts )
+		return current_ts;
+	    return watermark;
+	}
+
+	/** Sets a callback that gets called with the new watermark each time
+	 * it advances, after a call to step(). See getWatermark()
+	 */
+	void setWatermarkCallback( const watermark_callback_t &callback )
+	{
+	    watermark_callback = callback;
+	}
+
 	/**
 	 * clears all samples in all streams, resets the statistics
 	 * and resets the playback times  but leaves the stream
@@ -549,6 +1393,8 @@ namespace aggregator {
 	    
 	    latest_ts = base::Time();
 	    current_ts = base::Time();
+	    published_watermark = base::Time();
+	    resetHistograms();
 	    
 	    status.current_time = base::Time();
 	    status.latest_time = base::Time();
@@ -586,7 +1432,24 @@ namespace aggregator {
 	    if( !streams.at(idx) )
 		throw std::runtime_error("invalid stream index.");
 	    
-	    return streams[idx]->getBufferStatus();
+	    const StreamStatus &stream_status( streams[idx]->getBufferStatus() );
+	    streams[idx]->status.timeout = getEffectiveTimeout( *streams[idx] );
+	    if( streams[idx]->arrival_delay.getCount() > 0 )
+		streams[idx]->status.arrival_delay = base::Time::fromSeconds( streams[idx]->arrival_delay.getQuantile() );
+	    getPercentiles( streams[idx]->histograms.latency, streams[idx]->status.latency_percentiles );
+	    getPercentiles( streams[idx]->histograms.buffering, streams[idx]->status.buffering_percentiles );
+	    getPercentiles( streams[idx]->histograms.callback, streams[idx]->status.callback_percentiles );
+	    return stream_status;
+	}
+
+	/** @return the latency histograms of the given stream, see
+	 * setLatencyHistograms. StreamStatus only has their percentiles
+	 */
+	const StreamLatencyHistograms &getLatencyHistograms(int idx) const
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+	    return streams[idx]->histograms;
 	}
 
 	/** @return the current status of the StreamAligner
@@ -594,19 +1457,79 @@ namespace aggregator {
 	 */
 	const StreamAlignerStatus& getStatus() const 
 	{
-	    status.time = base::Time::now();
+	    status.time = clock->now();
 	    status.current_time = getCurrentTime();
 	    status.latest_time = getLatestTime();
+	    status.timeout = timeout;
+	    status.watermark = getWatermark();
 
 	    for(size_t i=0;i<streams.size();i++)
 	    {
 		if(streams[i])
-		    status.streams[i] = streams[i]->getBufferStatus();
+		    status.streams[i] = getBufferStatus(i);
 	    }
 
 	    return status;
 	}
 
+	/** Publishes a snapshot of getStatus() for readPublishedStatus()
+	 *
+	 * getStatus() and getBufferStatus() are not thread-safe. This must be
+	 * called from the thread that pushes data and calls step(), and
+	 * allows a single other thread to read the snapshot without locking
+	 * and without delaying that thread. See also
+	 * setStatusPublicationPeriod()
+	 */
+	void publishStatus()
+	{
+	    published_status.write( getStatus() );
+	}
+
+	/** Makes step() and stepUntil() call publishStatus() at most once per
+	 * \c period of the aligner's clock. Set to null to disable, which is
+	 * the default.
+	 */
+	void setStatusPublicationPeriod( const base::Time &period )
+	{
+	    status_period = period;
+	    status_publication_time = base::Time();
+	}
+
+	/** @return the last status given to publishStatus()
+	 *
+	 * This can be called from another thread than the one that uses the
+	 * aligner, but from a single one. The returned object is valid until
+	 * the next call. It is a default StreamAlignerStatus if no status has
+	 * been published yet, see hasPublishedStatus().
+	 */
+	const StreamAlignerStatus &readPublishedStatus()
+	{
+	    return published_status.read();
+	}
+
+	/** true if publishStatus() has been called at least once */
+	bool hasPublishedStatus() const
+	{
+	    return published_status.hasValue();
+	}
+
+	/** @return the current counters of the given stream
+	 *
+	 * Unlike getBufferStatus(), this can be called from any number of
+	 * other threads while data is being pushed and replayed, at any rate
+	 * and without delaying the aligner. Each counter is read atomically,
+	 * but the counters are not consistent with each other, e.g.
+	 * samples_received may already count a sample that is not yet
+	 * accounted for anywhere else. Streams must not be registered or
+	 * unregistered meanwhile.
+	 */
+	StreamCounters readStreamCounters(int idx) const
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+	    return streams[idx]->readCounters();
+	}
+
 	friend std::ostream &operator<<(std::ostream &stream, const aggregator::StreamAligner::StreamBase &base);
 	friend std::ostream &operator<<(std::ostream &stream, const aggregator::StreamAligner &re);
     };
@@ -9,18 +9,22 @@ std::ostream &operator<<(std::ostream &os, const aggregator::StreamAlignerStatus
 	<< " latest time: \t" 
 	<< " dropped late samples: \t" << status.samples_dropped_late_arriving 
 	<< " latency: \t" 
+	<< " timeout: \t" 
+	<< " watermark: \t" 
 	<< std::endl
 	<<  status.time
 	<< "\t" << status.current_time 
 	<< "\t" << status.latest_time 
 	<< "\t" << status.samples_dropped_late_arriving 
 	<< "\t" << status.latest_time - status.current_time 
+	<< "\t" << status.timeout 
+	<< "\t" << status.watermark 
 	<< std::endl;
 	
     if( status.streams.empty() )
     	return os; 
     
-    os << "idx\tname\t\tbsize\tbfill\treceived\tprocessed\tdr_bfull\tdr_late\tbackward time" << std::endl;
+    os << "idx\tname\t\tbsize\tbfill\treceived\tprocessed\tdr_bfull\tdr_late\tbackward time\treordered\tstalls" << std::endl;
 
     int cnt = 0;
     for(std::vector<aggregator::StreamStatus>::const_iterator it = status.streams.begin(); it != status.streams.end(); it++)
@@ -33,7 +37,7 @@ std::ostream &operator<<(std::ostream &os, const aggregator::StreamAlignerStatus
 	cnt++;
     }
     
-    os << "idx\tname\t\tlatest sample\tearliers data\tlatest data\tlatency" << std::endl;
+    os << "idx\tname\t\tlatest sample\tearliers data\tlatest data\tlatency\tsample latency\ttimeout\tarrival delay\tstall duration" << std::endl;
     
     for(std::vector<aggregator::StreamStatus>::const_iterator it = status.streams.begin(); it != status.streams.end(); it++)
     {
@@ -44,6 +48,25 @@ std::ostream &operator<<(std::ostream &os, const aggregator::StreamAlignerStatus
         }
 	cnt++;
     }
+
+    bool has_histograms = false;
+    for(std::vector<aggregator::StreamStatus>::const_iterator it = status.streams.begin(); it != status.streams.end(); it++)
+	has_histograms = has_histograms || it->latency_percentiles.count;
+    if( !has_histograms )
+	return os;
+
+    os << "idx\tname\t\tlatency p50/p99/p999/max\tbuffering p50/p99/p999/max\tcallback p50/p99/p999/max" << std::endl;
+
+    cnt = 0;
+    for(std::vector<aggregator::StreamStatus>::const_iterator it = status.streams.begin(); it != status.streams.end(); it++)
+    {
+	if(it->active)
+        {
+            os << cnt << "\t";
+            histograms(os, *it); 
+        }
+	cnt++;
+    }
     return os;
 }
 std::ostream& counters(std::ostream& os, const aggregator::StreamStatus& status)
@@ -57,6 +80,8 @@ std::ostream& counters(std::ostream& os, const aggregator::StreamStatus& status)
 	<< status.samples_dropped_buffer_full << "\t"
 	<< status.samples_dropped_late_arriving << "\t"
 	<< status.samples_backward_in_time << "\t"
+	<< status.samples_reordered << "\t"
+	<< status.stall_count << "\t"
 	<< std::endl;
     return os;
 }
@@ -68,9 +93,33 @@ std::ostream& timers(std::ostream& os, const aggregator::StreamStatus& status, b
 	<< status.latest_sample_time << "\t"
 	<< status.earliest_data_time << " \t "
 	<< status.latest_data_time << " \t " 
-	<< status.latest_sample_time - current_time 
+	<< status.latest_sample_time - current_time << " \t "
+	<< status.latency << " \t "
+	<< status.timeout << " \t "
+	<< status.arrival_delay << " \t "
+	<< status.total_stall_duration
 	<< std::endl;
     return os;
 }
 
+static std::ostream& percentiles(std::ostream& os, const aggregator::LatencyPercentiles& percentiles)
+{
+    using ::operator <<;
+    os 	
+	<< percentiles.p50 << "/"
+	<< percentiles.p99 << "/"
+	<< percentiles.p999 << "/"
+	<< percentiles.max;
+    return os;
+}
+
+std::ostream& histograms(std::ostream& os, const aggregator::StreamStatus& status)
+{
+    os << status.name << "\t\t";
+    percentiles(os, status.latency_percentiles) << " \t ";
+    percentiles(os, status.buffering_percentiles) << " \t ";
+    percentiles(os, status.callback_percentiles) << std::endl;
+    return os;
+}
+
 
@@ -3,9 +3,50 @@
 
 #include <base/Time.hpp>
 #include <vector>
+#include <stdint.h>
 
 namespace aggregator 
 {
+    /** Summary of the distribution of a duration recorded by the latency
+     * histograms of a stream, see StreamAligner::setLatencyHistograms
+     */
+    struct LatencyPercentiles
+    {
+	/** Count of recorded durations. The other fields are null if it is
+	 * zero
+	 */
+	uint64_t count;
+	base::Time p50;
+	base::Time p99;
+	base::Time p999;
+	base::Time max;
+
+	LatencyPercentiles() : count(0) {}
+    };
+
+    /** The counters of a single stream, see
+     * StreamAligner::readStreamCounters. The fields have the same meaning as
+     * the ones of the same name in StreamStatus
+     */
+    struct StreamCounters
+    {
+	size_t samples_received;
+	size_t samples_processed;
+	size_t samples_dropped_buffer_full;
+	size_t samples_dropped_late_arriving;
+	size_t samples_backward_in_time;
+	size_t samples_reordered;
+	size_t stall_count;
+
+	StreamCounters() : samples_received(0), samples_processed(0),
+			samples_dropped_buffer_full(0),
+			samples_dropped_late_arriving(0),
+			samples_backward_in_time(0), samples_reordered(0),
+			stall_count(0)
+	{
+	}
+    };
+
     /** Debugging structure used to report about the status of a single stream in a stream aligner
      */
     struct StreamStatus
@@ -45,6 +86,11 @@ namespace aggregator
 	 * sample received for that stream
 	 */
 	size_t samples_backward_in_time;
+	/** Count of samples that arrived out of order, but within the reorder
+	 * tolerance of the stream, and have been inserted at their sorted
+	 * position
+	 */
+	size_t samples_reordered;
 	/** Time of the newest sample currently stored in the stream buffer.
 	 * Null time if the stream is empty
 	 */
@@ -57,6 +103,51 @@ namespace aggregator
 	 * whether it has been dropped or pushed to the stream
 	 */
 	base::Time latest_sample_time;
+	/** The period used to compute the stream's lookahead. It is the
+	 * estimated period if period estimation is enabled
+	 */
+	base::Time period;
+	/** Latency of the last sample processed on this stream, i.e. the
+	 * difference between the aligner's latest time and the sample time when
+	 * it got processed
+	 */
+	base::Time latency;
+	/** The maximum time the stream aligner waits for samples on this
+	 * stream. In adaptive timeout mode, this is the timeout derived from
+	 * the arrival delays
+	 */
+	base::Time timeout;
+	/** The quantile of the arrival delay of the samples, i.e. of the
+	 * difference between the time they got pushed at and their timestamp.
+	 * Only computed in adaptive timeout mode
+	 */
+	base::Time arrival_delay;
+	/** Count of times the stream got deactivated because it stopped
+	 * receiving data, see StreamAligner::setStallDetection
+	 */
+	size_t stall_count;
+	/** Data time between the last sample before and the first sample after
+	 * the last stall
+	 */
+	base::Time last_stall_duration;
+	/** Sum of the durations of all stalls */
+	base::Time total_stall_duration;
+	/** Distribution of the data time latency of the processed samples, see
+	 * latency. Only recorded if enabled with
+	 * StreamAligner::setLatencyHistograms. The complete histograms are
+	 * given by StreamAligner::getLatencyHistograms
+	 */
+	LatencyPercentiles latency_percentiles;
+	/** Distribution of the wall-clock time the processed samples spent in
+	 * the stream aligner, between being pushed and being processed. Only
+	 * recorded if enabled with StreamAligner::setLatencyHistograms
+	 */
+	LatencyPercentiles buffering_percentiles;
+	/** Distribution of the wall-clock time spent processing a sample,
+	 * which is mostly the time spent in the stream's callback. Only
+	 * recorded if enabled with StreamAligner::setLatencyHistograms
+	 */
+	LatencyPercentiles callback_percentiles;
 	/** True if the stream is being used by the stream aligner */
 	bool active;
 	/** The stream name. In the case of the oroGen plugin, this is set to
@@ -72,7 +163,8 @@ namespace aggregator
 	StreamStatus() : buffer_size(0), buffer_fill(0), samples_received(0), 
 			samples_processed(0), samples_dropped_buffer_full(0), 
 			samples_dropped_late_arriving(0), 
-			samples_backward_in_time(0), active(true), priority(0)
+			samples_backward_in_time(0), samples_reordered(0),
+			stall_count(0), active(true), priority(0)
 	{
 	}
     };
@@ -99,6 +191,14 @@ namespace aggregator
 	/** Time of the last sample that got in the stream aligner
 	 */
 	base::Time latest_time;
+	/** No sample older than this time will be given to the stream aligner
+	 * callbacks anymore
+	 */
+	base::Time watermark;
+	/** The timeout set on the stream aligner. Streams can wait for less
+	 * than this, see StreamStatus::timeout
+	 */
+	base::Time timeout;
 	/** Count of samples that got dropped because, at the time they arrived,
 	 * they were older than the stream aligner's current time.
 	 * 
@@ -121,5 +221,6 @@ std::ostream &operator<<(std::ostream &os, const aggregator::StreamAlignerStatus
 std::ostream &operator<<(std::ostream &os, const aggregator::StreamStatus &status);
 std::ostream& counters(std::ostream& os, const aggregator::StreamStatus& status);
 std::ostream& timers(std::ostream& os, const aggregator::StreamStatus& status, base::Time current_time);
+std::ostream& histograms(std::ostream& os, const aggregator::StreamStatus& status);
 
 #endif
@@ -1,18 +1,105 @@
 #include "TimestampEstimator.hpp"
 #include <limits.h> //for INT_MAX
+#include <limits>
+#include <algorithm>
+#include <cmath>
 #include <iosfwd>
 #include <stdexcept>
 #include <iostream>
-#include <base/Float.hpp>
+#include <istream>
+#include <ostream>
+#include <utility>
 #include <base-logging/Logging.hpp>
 
 using namespace aggregator;
 using boost::circular_buffer;
 
+namespace
+{
+    /** Samples whose base times are within this tolerance, in seconds, are
+     * considered equivalent by the base time search */
+    const double BASE_TIME_TOLERANCE = 1e-9;
+
+    /** Count of samples converted at once by updateBatch */
+    const size_t BATCH_SIZE = 4096;
+
+    /** Minimum count of valid samples for PERIOD_DRIFT to use its
+     * second-order fit. A quadratic fit on fewer samples is dominated by the
+     * jitter, and a wrong period leads to wrongly detected losses */
+    const int DRIFT_MIN_SAMPLES = 30;
+
+    /** Count of base time searches of PERIOD_DRIFT per window, see
+     * updateSample() */
+    const int DRIFT_SEARCH_RATIO = 8;
+
+    /** Default quantile of the jitter used by getArrivalInterval */
+    const double DEFAULT_JITTER_QUANTILE = 0.99;
+
+    /** Minimum count of jitter observations before outliers get rejected */
+    const size_t OUTLIER_MIN_SAMPLES = 20;
+
+    /** Lower bound of the jitter deviation used by the outlier rejection,
+     * in periods, so that samples are not rejected for a tiny delay when
+     * the jitter is almost constant */
+    const double OUTLIER_MIN_DEVIATION = 0.01;
+
+    /** Converts a time relative to m_zero from the integer representation of
+     * m_samples to seconds. This is the same computation as
+     * base::Time::toSeconds() */
+    double toSeconds(int64_t time)
+    {
+        return static_cast<double>(time) / base::Time::UsecPerSec;
+    }
+
+    /** Identifies the data written by TimestampEstimator::save(), followed by
+     * the version of the format */
+    const uint32_t STATE_MAGIC = 0x54534553; // "TSES"
+    const uint32_t STATE_VERSION = 2;
+
+    template<typename T>
+    void writeValue(std::ostream& stream, T const& value)
+    {
+        stream.write(reinterpret_cast<char const*>(&value), sizeof(T));
+    }
+
+    template<typename T>
+    T readValue(std::istream& stream)
+    {
+        T value;
+        if (!stream.read(reinterpret_cast<char*>(&value), sizeof(T)))
+            throw std::runtime_error("truncated timestamp estimator state.");
+        return value;
+    }
+
+    /** The largest sample capacity that an estimator with the given window
+     * may reach
+     *
+     * The capacity follows the count of samples in the window, and the
+     * sample times have a resolution of one microsecond. save() stores the
+     * capacity on 32 bits */
+    double maxSampleCapacity(double window)
+    {
+        return std::min<double>(2 * (window * base::Time::UsecPerSec + 1) + 20,
+                std::numeric_limits<uint32_t>::max());
+    }
+
+    bool isNewerLine(const LowerEnvelopeQueue::Line &a, const LowerEnvelopeQueue::Line &b)
+    {
+        return a.id > b.id;
+    }
+}
+
 TimestampEstimator::TimestampEstimator(base::Time window,
 				       base::Time initial_period,
 				       base::Time initial_latency,
 				       int lost_threshold)
+    : m_self_check(false)
+    , m_period_estimation(PERIOD_FROM_ENDPOINTS)
+    , m_jitter(DEFAULT_JITTER_QUANTILE)
+    , m_outlier_threshold(0)
+    , m_max_consecutive_outliers(0)
+    , m_clock(Clock::getSystemClock())
+    , m_publish_status(false)
 {
     reset(window, initial_period, initial_latency, lost_threshold);
 }
@@ -20,12 +107,26 @@ TimestampEstimator::TimestampEstimator(base::Time window,
 TimestampEstimator::TimestampEstimator(base::Time window,
 				       base::Time initial_period,
 				       int lost_threshold)
+    : m_self_check(false)
+    , m_period_estimation(PERIOD_FROM_ENDPOINTS)
+    , m_jitter(DEFAULT_JITTER_QUANTILE)
+    , m_outlier_threshold(0)
+    , m_max_consecutive_outliers(0)
+    , m_clock(Clock::getSystemClock())
+    , m_publish_status(false)
 {
     reset(window, initial_period, base::Time(), lost_threshold);
 }
 
 TimestampEstimator::TimestampEstimator(base::Time window,
 				       int lost_threshold)
+    : m_self_check(false)
+    , m_period_estimation(PERIOD_FROM_ENDPOINTS)
+    , m_jitter(DEFAULT_JITTER_QUANTILE)
+    , m_outlier_threshold(0)
+    , m_max_consecutive_outliers(0)
+    , m_clock(Clock::getSystemClock())
+    , m_publish_status(false)
 {
     reset(window, base::Time(), base::Time(), lost_threshold);
 }
@@ -83,9 +184,17 @@ void TimestampEstimator::internalReset(double window,
     m_base_time_reset_offset = 0;
     m_last_reference = base::Time();
     m_latency = initial_latency;
+    m_latency_raw = 0;
     m_initial_latency = initial_latency;
+    m_max_jitter = 0;
+    m_jitter.reset();
+    m_jitter_median.reset();
+    m_jitter_deviation.reset();
+    m_pending_outliers.clear();
+    m_outliers_suspended = false;
+    m_outliers_total = 0;
     m_initial_period = initial_period;
-    m_missing_samples = 0;
+    m_restored_period = 0;
     m_missing_samples_total = 0;
     m_last_index = 0;
     m_have_last_index = false;
@@ -93,18 +202,26 @@ void TimestampEstimator::internalReset(double window,
     m_rejected_expected_losses = 0;
     m_expected_loss_timeout = 0;
 
-    m_samples.clear();
+    clearSamples();
     if (m_initial_period > 0)
-        m_samples.set_capacity(10 + (m_window + m_initial_period) / m_initial_period);
+        setSampleCapacity(10 + (m_window + m_initial_period) / m_initial_period);
     else
-        m_samples.set_capacity(20); // should be enough to get us a first period estimate
+        setSampleCapacity(20); // should be enough to get us a first period estimate
+    publishStatus();
 }
 
 base::Time TimestampEstimator::getPeriod() const
 { return base::Time::fromSeconds(getPeriodInternal()); }
 double TimestampEstimator::getPeriodInternal() const
 {
-    if (!m_got_full_window && m_initial_period)
+    // Once it has enough samples, the drift fit is more accurate than the
+    // initial period even if the window is not full yet
+    bool use_drift = m_period_estimation == PERIOD_DRIFT && m_fit_count >= DRIFT_MIN_SAMPLES;
+    //ignore lost samples at the end of m_samples
+    int count = m_samples.size() - m_trailing_missing;
+    // The initial period is also used if the samples got dropped after the
+    // window got full, e.g. after a long interruption of the stream
+    if ((!m_got_full_window || count <= 1) && m_initial_period && !use_drift)
     {
         // The main problem with using an initial period is that the estimator
         // gets lost if the period is under-estimated.
@@ -127,32 +244,155 @@ double TimestampEstimator::getPeriodInternal() const
     }
     else
     {
-        int count = m_samples.size();
-        circular_buffer<double>::const_reverse_iterator latest_it;
-        //ignore lost samples(unset value) at the end of m_samples
-        for(latest_it = m_samples.rbegin();
-                (latest_it != m_samples.rend()) && base::isUnset(*latest_it);
-                latest_it++, count--)
-        {}
         if (count <= 1)
             throw std::logic_error("getPeriodInternal() called with no initial period and less than 2 valid samples");
 
-        double latest = *latest_it;
-        // m_samples.front() is valid as shortenSampleList makes sure that it is
-        double earliest = m_samples.front();
+        double period, offset, period_rate;
+        if (use_drift && getDriftFit(m_samples.size() - 1, period, period_rate) && period > 0)
+            return period;
+        // PERIOD_DRIFT falls back to the linear fit until it has enough
+        // samples
+        if (m_period_estimation != PERIOD_FROM_ENDPOINTS && getLeastSquaresFit(period, offset))
+            return period;
 
-        if (base::isUnset(latest))
+        // m_samples.front() is valid as shortenSampleList makes sure that it is
+        if (m_missing_mask[count - 1])
         {
             dumpInternalState();
-            throw std::logic_error("getPeriodInternal(): latest == NaN");
+            throw std::logic_error("getPeriodInternal(): latest sample is missing");
 
         }
-        else if (base::isUnset(earliest))
+        else if (m_missing_mask.front())
         {
             dumpInternalState();
-            throw std::logic_error("getPeriodInternal(): earliest == NaN");
+            throw std::logic_error("getPeriodInternal(): earliest sample is missing");
         }
-        return (latest - earliest) / (count - 1);
+        return toSeconds(m_samples[count - 1] - m_samples.front()) / (count - 1);
+    }
+}
+
+bool TimestampEstimator::getLeastSquaresFit(double& period, double& offset) const
+{
+    if (m_fit_count < 2)
+        return false;
+
+    double n = m_fit_count;
+    double mean_k = m_fit_k.sum / n;
+    double mean_t = m_fit_t.sum / n;
+    double var_k  = m_fit_kk.sum / n - mean_k * mean_k;
+    double cov_kt = m_fit_kt.sum / n - mean_k * mean_t;
+    if (var_k <= 0)
+        return false;
+
+    period = cov_kt / var_k;
+    offset = mean_t - period * mean_k;
+    return true;
+}
+
+bool TimestampEstimator::getDriftFit(double k, double& period, double& period_rate) const
+{
+    DriftModel model;
+    if (!getDriftModel(model))
+        return false;
+    period = model.at(k) - model.at(k - 1);
+    period_rate = 2 * model.c;
+    return true;
+}
+
+bool TimestampEstimator::getDriftModel(DriftModel& model) const
+{
+    if (m_fit_count < 3)
+        return false;
+
+    // Fit time = mean_t + b * (k - mean_k) + c * ((k - mean_k)^2 - m2)
+    // using the central moments of k, which are much better conditioned
+    // than the raw sums
+    double n = m_fit_count;
+    double mean_k = m_fit_k.sum / n;
+    double mean_t = m_fit_t.sum / n;
+    double e2 = m_fit_kk.sum / n;
+    double e3 = m_fit_kkk.sum / n;
+    double e4 = m_fit_kkkk.sum / n;
+    double m2 = e2 - mean_k * mean_k;
+    double m3 = e3 - 3 * mean_k * e2 + 2 * mean_k * mean_k * mean_k;
+    double m4 = e4 - 4 * mean_k * e3 + 6 * mean_k * mean_k * e2 - 3 * mean_k * mean_k * mean_k * mean_k;
+
+    double ekt = m_fit_kt.sum / n;
+    double ekkt = m_fit_kkt.sum / n;
+    double cov1 = ekt - mean_k * mean_t;
+    double cov2 = ekkt - 2 * mean_k * ekt + mean_k * mean_k * mean_t - m2 * mean_t;
+
+    double det = m2 * (m4 - m2 * m2) - m3 * m3;
+    if (m2 <= 0 || det <= 0)
+        return false;
+
+    model.mean_k = mean_k;
+    model.mean_t = mean_t;
+    model.m2 = m2;
+    model.b = (cov1 * (m4 - m2 * m2) - m3 * cov2) / det;
+    model.c = (m2 * cov2 - m3 * cov1) / det;
+    return true;
+}
+
+double TimestampEstimator::getPeriodDrift() const
+{
+    double period, period_rate;
+    if (m_period_estimation != PERIOD_DRIFT || !getDriftFit(m_samples.size() - 1, period, period_rate) || period <= 0)
+        return 0;
+    return period_rate / period;
+}
+
+void TimestampEstimator::updateFit(double k, double time, int sign)
+{
+    if (m_period_estimation == PERIOD_FROM_ENDPOINTS)
+        return;
+
+    double kk = k * k;
+    m_fit_count += sign;
+    m_fit_k.add(sign * k);
+    m_fit_kk.add(sign * kk);
+    m_fit_kkk.add(sign * kk * k);
+    m_fit_kkkk.add(sign * kk * kk);
+    m_fit_t.add(sign * time);
+    m_fit_kt.add(sign * k * time);
+    m_fit_kkt.add(sign * kk * time);
+}
+
+void TimestampEstimator::shiftFit(double count)
+{
+    // The index of all remaining samples decreases by count. The higher
+    // order sums are updated first, as they depend on the lower order ones
+    if (m_period_estimation == PERIOD_FROM_ENDPOINTS)
+        return;
+
+    double d = count, d2 = d * d, n = m_fit_count;
+    m_fit_kkkk.add(-4 * d * m_fit_kkk.sum + 6 * d2 * m_fit_kk.sum - 4 * d2 * d * m_fit_k.sum + d2 * d2 * n);
+    m_fit_kkk.add(-3 * d * m_fit_kk.sum + 3 * d2 * m_fit_k.sum - d2 * d * n);
+    m_fit_kk.add(d * (d * n - 2 * m_fit_k.sum));
+    m_fit_kkt.add(-2 * d * m_fit_kt.sum + d2 * m_fit_t.sum);
+    m_fit_kt.add(-d * m_fit_t.sum);
+    m_fit_k.add(-d * n);
+}
+
+void TimestampEstimator::clearFit()
+{
+    m_fit_count = 0;
+    m_fit_k = CompensatedSum();
+    m_fit_kk = CompensatedSum();
+    m_fit_kkk = CompensatedSum();
+    m_fit_kkkk = CompensatedSum();
+    m_fit_t = CompensatedSum();
+    m_fit_kt = CompensatedSum();
+    m_fit_kkt = CompensatedSum();
+}
+
+void TimestampEstimator::rebuildFit()
+{
+    clearFit();
+    for (size_t i = 0; i < m_samples.size(); ++i)
+    {
+        if (!m_missing_mask[i])
+            updateFit(i, toSeconds(m_samples[i]), 1);
     }
 }
 
@@ -162,15 +402,18 @@ void TimestampEstimator::dumpInternalState() const
     std::cout << "  capacity=" << m_samples.capacity() << std::endl;
     std::cout << "  m_missing_samples=" << m_missing_samples << std::endl;
     std::cout << "  m_missing_samples_total=" << m_missing_samples_total << std::endl;
-    circular_buffer<double>::const_iterator it;
     int count = 0;
-    for (it = m_samples.begin(); it != m_samples.end(); ++it)
+    for (size_t i = 0; i < m_samples.size(); ++i)
     {
-        std::cout << *it << std::endl;
-        if (base::isUnset(*it))
+        if (m_missing_mask[i])
+        {
+            std::cout << "missing" << std::endl;
             count++;
+        }
+        else
+            std::cout << toSeconds(m_samples[i]) << std::endl;
     }
-    std::cout << "  found " << count << " unset samples in the buffer" << std::endl;
+    std::cout << "  found " << count << " missing samples in the buffer" << std::endl;
 }
 
 int TimestampEstimator::getLostSampleCount() const
@@ -184,67 +427,168 @@ void TimestampEstimator::shortenSampleList(double current)
 	double period = getPeriodInternal();
 
         //scan forward until we hit the window size, and unconditionally skip
-        //any lost samples queued at the end of sample list in the process
-        circular_buffer<double>::iterator end = m_samples.begin();
-	double min_time = current - m_window;
-	while(end != m_samples.end() && (base::isUnset(*end) || *end < min_time))
+        //any lost samples queued at the end of sample list in the process.
+        //The samples skipped by the last call are skipped again, unless
+        //the window moved backward
+        //samples are in microseconds, sample < current - m_window is
+        //equivalent to sample < min_time
+	int64_t min_time = std::ceil((current - m_window) * base::Time::UsecPerSec);
+        uint64_t end = m_front_seq;
+        if (min_time >= m_window_min_time && m_window_begin > end)
+            end = m_window_begin;
+        m_window_min_time = min_time;
+
+        uint64_t samples_end = m_front_seq + m_samples.size();
+	while(end != samples_end && (isMissing(end) || getSample(end) < min_time))
         {
-            if (!base::isUnset(*end))
+            if (!isMissing(end))
                 m_got_full_window = true;
 	    end++;
         }
+        m_window_begin = end;
 
-        if (end == m_samples.end())
+        if (end == samples_end)
         {
-            m_samples.clear();
-            m_missing_samples = 0;
+            clearSamples();
             return;
         }
 
         // window_begin is guaranteed to point to a valid sample
-        circular_buffer<double>::iterator window_begin = end;
+        uint64_t window_begin = end;
 
-	//scan backward until we find a gap that is at least period sized.
-	//that should be the last sample from a burst, giving better
-	//period estimation
-        //
-        //The 0.9 factor on the period is here to allow a bit of jitter.
-        //Otherwise, we might end up keeping too much data for too long
-        circular_buffer<double>::iterator last_good = end;
-	int sample_count = 0;
-	while (end != m_samples.begin())
-	{
-	    if (!base::isUnset(*end))
-	    {
-		if (sample_count > 0 && (*last_good-*end) / sample_count >= 0.5 * period)
-		    break;
-
-		last_good = end;
-		sample_count = 0;
-	    }
-	    end--;
-	    sample_count++;
-	}
+	//find the last gap before the window that is at least half a period
+	//wide. That should be the last sample from a burst, giving better
+	//period estimation. The front sample is never considered.
+        updateGaps(window_begin);
+        while (!m_gaps.empty() && m_gaps.front().seq <= m_front_seq)
+            m_gaps.pop_front();
+
+        // m_gaps is sorted by decreasing gaps, count the ones that are big
+        // enough
+        double min_gap = 0.5 * period;
+        size_t low = 0, high = m_gaps.size();
+        while (low < high)
+        {
+            size_t mid = (low + high) / 2;
+            if (m_gaps[mid].gap >= min_gap)
+                low = mid + 1;
+            else
+                high = mid;
+        }
 
 	//if we didn't find anything, fall back to real window begin
-	if (end == m_samples.begin() || (*end < min_time - m_window))
+        int64_t window = std::ceil(m_window * base::Time::UsecPerSec);
+        if (low > 0 && !(getSample(m_gaps[low - 1].seq) < min_time - window))
+            end = m_gaps[low - 1].seq;
+        else
 	    end = window_begin;
+        if (m_self_check)
+            checkWindowStart(window_begin, min_time, period, end);
 
-        // Update the m_missing_samples counter
-        circular_buffer<double>::iterator it;
-	for(it = m_samples.begin(); it != end; it++) {
-	    if (base::isUnset(*it))
-		m_missing_samples--;
-	}
-
-	m_samples.erase(m_samples.begin(), end);
+        eraseSamples(end - m_front_seq);
     }
 
     if (m_samples.size() == m_missing_samples)
+        clearSamples();
+}
+
+void TimestampEstimator::checkWindowStart(uint64_t window_begin, int64_t min_time, double period, uint64_t result) const
+{
+    // Scan backward until a gap of at least half a period is found
+    uint64_t end = window_begin;
+    uint64_t last_good = end;
+    int sample_count = 0;
+    while (end != m_front_seq)
     {
-	m_samples.clear();
-	m_missing_samples = 0;
+        if (!isMissing(end))
+        {
+            if (sample_count > 0 && toSeconds(getSample(last_good) - getSample(end)) / sample_count >= 0.5 * period)
+                break;
+            last_good = end;
+            sample_count = 0;
+        }
+        end--;
+        sample_count++;
     }
+
+    int64_t window = std::ceil(m_window * base::Time::UsecPerSec);
+    if (end == m_front_seq || getSample(end) < min_time - window)
+        end = window_begin;
+    if (end != result)
+        throw std::logic_error("TimestampEstimator: the window start differs from the one of a linear scan");
+}
+
+void TimestampEstimator::checkBaseTime(double period, double base_time, double base_time_reset) const
+{
+    double expected = toSeconds(m_samples.back());
+    double expected_reset = expected;
+    int base_count = 1;
+    for (size_t i = m_samples.size() - 1; i > 0; --i, ++base_count)
+    {
+        if (m_missing_mask[i - 1])
+            continue;
+        double sample = toSeconds(m_samples[i - 1]);
+        if (sample < expected - base_count * period)
+        {
+            expected = sample + base_count * period;
+            expected_reset = sample;
+        }
+    }
+    if (expected != base_time || expected_reset != base_time_reset)
+        throw std::logic_error("TimestampEstimator: the base time differs from the one of a linear scan");
+}
+
+void TimestampEstimator::setSelfCheck(bool enable)
+{
+    m_self_check = enable;
+}
+
+void TimestampEstimator::setSampleStorage(std::shared_ptr<ArenaSlot> const& samples,
+        std::shared_ptr<ArenaSlot> const& missing_mask)
+{
+    // Both buffers are copied before any of them gets replaced, so that a
+    // failed allocation leaves the estimator unchanged
+    circular_buffer<int64_t, ArenaAllocator<int64_t> > new_samples(
+            m_samples.capacity(), m_samples.begin(), m_samples.end(),
+            ArenaAllocator<int64_t>(samples));
+    circular_buffer<bool, ArenaAllocator<bool> > new_missing_mask(
+            m_missing_mask.capacity(), m_missing_mask.begin(), m_missing_mask.end(),
+            ArenaAllocator<bool>(missing_mask));
+    m_samples = std::move(new_samples);
+    m_missing_mask = std::move(new_missing_mask);
+}
+
+void TimestampEstimator::updateGaps(uint64_t window_begin)
+{
+    if (window_begin < m_gaps_end)
+    {
+        // The window moved backward, start over
+        m_gaps.clear();
+        m_gaps_end = m_front_seq;
+        m_gaps_have_last_valid = false;
+    }
+
+    for (uint64_t seq = std::max(m_gaps_end, m_front_seq); seq <= window_begin; ++seq)
+    {
+        if (isMissing(seq))
+            continue;
+
+        if (m_gaps_have_last_valid && m_gaps_last_valid >= m_front_seq)
+        {
+            Gap gap;
+            gap.seq = m_gaps_last_valid;
+            gap.gap = toSeconds(getSample(seq) - getSample(m_gaps_last_valid)) / static_cast<int>(seq - m_gaps_last_valid);
+
+            // Gaps that are smaller than a later one are never the latest
+            // big enough gap
+            while (!m_gaps.empty() && m_gaps.back().gap <= gap.gap)
+                m_gaps.pop_back();
+            m_gaps.push_back(gap);
+        }
+        m_gaps_last_valid = seq;
+        m_gaps_have_last_valid = true;
+    }
+    m_gaps_end = window_begin + 1;
 }
 
 base::Time TimestampEstimator::update(base::Time time)
@@ -252,8 +596,88 @@ base::Time TimestampEstimator::update(base::Time time)
     if (m_zero.isNull())
         m_zero = time;
 
-    // We use doubles internally. Convert to it.
-    double current = (time - m_zero).toSeconds();
+    base::Time result = base::Time::fromSeconds(updateInternal((time - m_zero).toMicroseconds())) + m_zero;
+    publishStatus();
+    return result;
+}
+
+void TimestampEstimator::updateBatch(base::Time const* times, base::Time* result, size_t count)
+{
+    updateBatch(times, 0, result, count);
+}
+
+void TimestampEstimator::updateBatch(base::Time const* times, int64_t const* indexes, base::Time* result, size_t count)
+{
+    if (count == 0)
+        return;
+    if (m_zero.isNull())
+        m_zero = times[0];
+
+    m_batch.resize(std::min(count, BATCH_SIZE));
+    for (size_t begin = 0; begin < count; begin += BATCH_SIZE)
+    {
+        size_t size = std::min(count - begin, BATCH_SIZE);
+
+        // The conversion does not depend on the estimator state, do it in
+        // a separate loop that the compiler can vectorize. It must be done
+        // before writing result, as it may be the same array as times
+        for (size_t i = 0; i < size; ++i)
+            m_batch[i] = (times[begin + i] - m_zero).toMicroseconds();
+
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (indexes)
+                updateIndex(indexes[begin + i]);
+            result[begin + i] = base::Time::fromSeconds(updateInternal(m_batch[i])) + m_zero;
+        }
+        publishStatus();
+    }
+}
+
+double TimestampEstimator::updateInternal(int64_t current_sample)
+{
+    // An outlier is stamped as if it had been received without jitter. It
+    // is replaced by a missing sample, so that the following samples keep
+    // their place in the window
+    if (m_outlier_threshold > 0 && !m_samples.empty() && haveEstimate())
+    {
+        double period = getPeriodInternal();
+        if (!isOutlier(toSeconds(current_sample), period))
+        {
+            m_pending_outliers.clear();
+            m_outliers_suspended = false;
+        }
+        else if (m_pending_outliers.size() < static_cast<size_t>(m_max_consecutive_outliers) && !m_outliers_suspended)
+        {
+            m_pending_outliers.push_back(current_sample);
+            m_outliers_total++;
+            pushMissingSample();
+            m_missing_samples++;
+            m_last += period;
+            return m_last - m_latency;
+        }
+        else if (!m_pending_outliers.empty())
+        {
+            // Too many late samples in a row, they were not outliers
+            m_outliers_suspended = true;
+            std::vector<int64_t> pending;
+            pending.swap(m_pending_outliers);
+            m_last -= period * pending.size();
+            m_outliers_total -= pending.size();
+            for (size_t i = 0; i < pending.size(); ++i)
+                popSample();
+            for (size_t i = 0; i < pending.size(); ++i)
+                updateSample(pending[i]);
+        }
+    }
+    return updateSample(current_sample);
+}
+
+double TimestampEstimator::updateSample(int64_t current_sample)
+{
+    // The samples are stored as integers, but the estimate is computed in
+    // seconds
+    double current = toSeconds(current_sample);
 
     // Remove values from m_samples that are outside the required window
     shortenSampleList(current);
@@ -261,42 +685,119 @@ base::Time TimestampEstimator::update(base::Time time)
     // If there are no samples so far, reinitialize the state of the estimator
     if (m_samples.empty())
     {
+        if (m_restored_period)
+        {
+            m_initial_period = m_restored_period;
+            m_restored_period = 0;
+        }
         resetBaseTime(current, current);
-        m_samples.push_back(current);
-        return base::Time::fromSeconds(m_last - m_latency) + m_zero;
+        pushSample(current_sample);
+        return m_last - m_latency;
     }
 
-    pushSample(current);
+    // The samples lost before the current one are counted with the period
+    // of the samples before it, as the current sample's place in the window
+    // is only known once they are
+    double loss_period = haveEstimate() ? getPeriodInternal() : 0;
+
+    // A drift period that is too small makes the samples look late, and the
+    // losses wrongly detected because of it skew the fit even more. Count
+    // them with the average period of the window if it is bigger
+    double average_period, offset;
+    if (loss_period && m_period_estimation == PERIOD_DRIFT &&
+            getLeastSquaresFit(average_period, offset) && average_period > loss_period)
+        loss_period = average_period;
+
+    pushSample(current_sample);
 
     // Recompute the period
     double period = getPeriodInternal();
+    if (loss_period == 0)
+        loss_period = period;
 
     // To avoid long-term effects of estimation errors, the base time must be
     // updated at least once in a time window.
     //
     // In principle, it should not happen
-    if (current - m_base_time_reset > m_window)
+    DriftModel model;
+    bool use_drift = m_period_estimation == PERIOD_DRIFT && m_fit_count >= DRIFT_MIN_SAMPLES && getDriftModel(model);
+    if (use_drift && (current - m_base_time_reset > m_window || --m_drift_search_countdown <= 0))
+    {
+        // With a drifting period, the distance between two samples is not
+        // proportional to the count of samples between them, so the base
+        // time envelope cannot be used. Use the drift model instead, at the
+        // price of a scan of the whole window.
+        //
+        // Between two searches, the base time is extrapolated with the
+        // period of the newest samples, whose errors add up. The search is
+        // therefore done DRIFT_SEARCH_RATIO times per window, which is
+        // amortized O(1)
+        m_drift_search_countdown = std::max(1, m_fit_count / DRIFT_SEARCH_RATIO);
+        double base_time = current;
+        double base_time_reset = current;
+        double current_k = m_samples.size() - 1;
+        for (size_t i = 0; i < m_samples.size() - 1; ++i)
+        {
+            if (m_missing_mask[i])
+                continue;
+            double sample = toSeconds(m_samples[i]);
+            double sample_base = sample + model.at(current_k) - model.at(i);
+            if (sample_base < base_time)
+            {
+                base_time = sample_base;
+                base_time_reset = sample;
+            }
+        }
+        resetBaseTime(base_time - period, base_time_reset);
+    }
+    else if (current - m_base_time_reset > m_window)
     {
         double base_time = current;
         double base_time_reset = current;
-        int base_count = 0;
-
-        circular_buffer<double>::const_reverse_iterator it = m_samples.rbegin();
-        // This code works as
-        //      *it < base_time - base_count * period,
-        // means that
-        //      *it + period > base_time - (base_count - 1) * period
-        // i.e. the sample at *it has a lower jitter than the one at base_time
-        // and we therefore should use it as the new base time
-        for (++it, ++base_count; it != m_samples.rend(); ++it, ++base_count)
+
+        // The new base time is the lowest of sample + base_count * period,
+        // base_count being the distance of the sample to the current one,
+        // i.e. the one of the sample that has the lowest jitter. This is the
+        // sample that minimizes sample - seq * period, which
+        // m_base_time_envelope finds for any period.
+        uint64_t current_seq = m_front_seq + m_samples.size() - 1;
+        while (!m_base_time_envelope.empty() && m_base_time_envelope.front().id < static_cast<int64_t>(m_front_seq))
+            m_base_time_envelope.pop();
+        for (m_base_time_envelope_end = std::max(m_base_time_envelope_end, m_front_seq);
+                m_base_time_envelope_end < current_seq; ++m_base_time_envelope_end)
+        {
+            if (!isMissing(m_base_time_envelope_end))
+                m_base_time_envelope.push(toSeconds(getSample(m_base_time_envelope_end)), -static_cast<double>(m_base_time_envelope_end), m_base_time_envelope_end);
+        }
+
+        if (!m_base_time_envelope.empty())
         {
-            if (!base::isUnset(*it) && (*it < base_time - base_count * period))
+            // Samples that are equivalent up to rounding errors are compared
+            // from the newest to the oldest
+            m_base_time_candidates.clear();
+            m_base_time_envelope.getMinima(period, BASE_TIME_TOLERANCE, m_base_time_candidates);
+            std::sort(m_base_time_candidates.begin(), m_base_time_candidates.end(), isNewerLine);
+
+            for (size_t i = 0; i < m_base_time_candidates.size(); ++i)
             {
-                base_time = *it + base_count * period;
-                base_time_reset = *it;
+                double sample = m_base_time_candidates[i].a;
+                int base_count = current_seq - m_base_time_candidates[i].id;
+                // This code works as
+                //      sample < base_time - base_count * period,
+                // means that
+                //      sample + period > base_time - (base_count - 1) * period
+                // i.e. the sample has a lower jitter than the one at base_time
+                // and we therefore should use it as the new base time
+                if (sample < base_time - base_count * period)
+                {
+                    base_time = sample + base_count * period;
+                    base_time_reset = sample;
+                }
             }
         }
 
+        if (m_self_check)
+            checkBaseTime(period, base_time, base_time_reset);
         resetBaseTime(base_time - period, base_time_reset);
     }
 
@@ -330,7 +831,7 @@ base::Time TimestampEstimator::update(base::Time time)
         // We calculate a different sample_distance. If we have some suspicion
         // that we did lose samples, we take timestamps that are at 1.9 * period
         // as distance=2 instead of 1 in the normal case
-        int sample_distance = (current - m_last + period * 0.1) / period;
+        int sample_distance = (current - m_last + loss_period * 0.1) / loss_period;
         if (sample_distance > 1)
         {
             lost_count = std::min(sample_distance - 1, m_expected_losses);
@@ -339,7 +840,7 @@ base::Time TimestampEstimator::update(base::Time time)
     }
     else if (m_lost_threshold != INT_MAX)
     {
-        int sample_distance = (current - m_last) / period;
+        int sample_distance = (current - m_last) / loss_period;
         if (sample_distance > 1)
         {
             m_lost.push_back(sample_distance - 1);
@@ -350,15 +851,15 @@ base::Time TimestampEstimator::update(base::Time time)
 
     if (lost_count > 0)
     {
-        m_samples.pop_back();
+        popSample();
         for (int i = 0; i < lost_count; ++i)
         {
             m_missing_samples++;
             m_missing_samples_total++;
-            pushSample(base::unset<double>());
+            pushMissingSample();
             m_last += period;
         }
-        pushSample(current);
+        pushSample(current_sample);
         m_lost.clear();
     }
 
@@ -378,10 +879,58 @@ base::Time TimestampEstimator::update(base::Time time)
 
     if (!m_last_reference.isNull())
         m_latency_raw = m_last - (m_last_reference - m_zero).toSeconds();
-    return base::Time::fromSeconds(m_last - m_latency) + m_zero;
+
+    // m_last is the time at which the sample would have been received
+    // without jitter
+    double jitter = current - m_last;
+    if (jitter > m_max_jitter)
+        m_max_jitter = jitter;
+    // The jitter is over-estimated until the first window got full, don't
+    // let it skew the quantile
+    if (m_got_full_window)
+    {
+        m_jitter.update(jitter);
+        if (m_outlier_threshold > 0)
+        {
+            if (m_jitter_median.getCount())
+                m_jitter_deviation.update(std::fabs(jitter - m_jitter_median.getQuantile()));
+            m_jitter_median.update(jitter);
+        }
+    }
+    return m_last - m_latency;
+}
+
+base::Time TimestampEstimator::update()
+{
+    return update(m_clock->now());
+}
+
+void TimestampEstimator::setClock(ClockPtr clock)
+{
+    m_clock = clock;
 }
 
-void TimestampEstimator::pushSample(double current)
+void TimestampEstimator::setPeriodEstimation(PeriodEstimation mode)
+{
+    // The least-squares sums are not maintained with PERIOD_FROM_ENDPOINTS
+    bool had_fit = m_period_estimation != PERIOD_FROM_ENDPOINTS;
+    m_period_estimation = mode;
+    if (!had_fit && mode != PERIOD_FROM_ENDPOINTS)
+        rebuildFit();
+}
+
+TimestampEstimator::PeriodEstimation TimestampEstimator::getPeriodEstimation() const
+{
+    return m_period_estimation;
+}
+
+void TimestampEstimator::setSampleCapacity(size_t capacity)
+{
+    m_samples.set_capacity(capacity);
+    m_missing_mask.set_capacity(capacity);
+}
+
+void TimestampEstimator::reserveSample()
 {
     // If we have an initial period, m_samples has been sized already. Since
     // push_back will override the beginning of the circular buffer, there is
@@ -396,18 +945,106 @@ void TimestampEstimator::pushSample(double current)
             double period = getPeriodInternal();
             size_t new_capacity = 1.5 * (m_window + period) / period;
             if (m_samples.capacity() < new_capacity)
-                m_samples.set_capacity(new_capacity);
+                setSampleCapacity(new_capacity);
             else
-                m_samples.set_capacity(20 + m_samples.capacity());
+                setSampleCapacity(20 + m_samples.capacity());
         }
         else
         {
-            m_samples.set_capacity(20 + m_samples.capacity());
+            setSampleCapacity(20 + m_samples.capacity());
         }
     }
+}
+
+void TimestampEstimator::pushSample(int64_t current)
+{
+    reserveSample();
 
     // Add the new input to the sample set
     m_samples.push_back(current);
+    m_missing_mask.push_back(false);
+    m_trailing_missing = 0;
+    updateFit(m_samples.size() - 1, toSeconds(current), 1);
+}
+
+void TimestampEstimator::pushMissingSample()
+{
+    reserveSample();
+
+    // The value of a missing sample is never read
+    m_samples.push_back(m_samples.empty() ? 0 : m_samples.back());
+    m_missing_mask.push_back(true);
+    m_trailing_missing++;
+}
+
+void TimestampEstimator::popSample()
+{
+    uint64_t seq = m_front_seq + m_samples.size() - 1;
+    if (m_missing_mask.back())
+    {
+        m_missing_samples--;
+        m_trailing_missing--;
+        m_samples.pop_back();
+        m_missing_mask.pop_back();
+    }
+    else
+    {
+        updateFit(m_samples.size() - 1, toSeconds(m_samples.back()), -1);
+        m_samples.pop_back();
+        m_missing_mask.pop_back();
+        m_trailing_missing = 0;
+        for (circular_buffer<bool, ArenaAllocator<bool> >::const_reverse_iterator it = m_missing_mask.rbegin();
+                it != m_missing_mask.rend() && *it; ++it)
+            m_trailing_missing++;
+    }
+
+    // Forget about the removed sample in the search structures
+    if (m_window_begin > seq)
+        m_window_begin = seq;
+    if (m_gaps_end > seq)
+    {
+        m_gaps.clear();
+        m_gaps_end = m_front_seq;
+        m_gaps_have_last_valid = false;
+    }
+    if (m_base_time_envelope_end > seq)
+    {
+        m_base_time_envelope.clear();
+        m_base_time_envelope_end = m_front_seq;
+    }
+}
+
+void TimestampEstimator::eraseSamples(size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (m_missing_mask[i])
+            m_missing_samples--;
+        else
+            updateFit(i, toSeconds(m_samples[i]), -1);
+    }
+    m_samples.erase_begin(count);
+    m_missing_mask.erase_begin(count);
+    m_front_seq += count;
+    shiftFit(count);
+}
+
+void TimestampEstimator::clearSamples()
+{
+    m_samples.clear();
+    m_missing_mask.clear();
+    m_missing_samples = 0;
+    m_trailing_missing = 0;
+    m_front_seq = 0;
+    m_window_begin = 0;
+    m_window_min_time = std::numeric_limits<int64_t>::min();
+    m_gaps.clear();
+    m_gaps_end = 0;
+    m_gaps_have_last_valid = false;
+    m_base_time_envelope.clear();
+    m_base_time_envelope_end = 0;
+    clearFit();
+    m_drift_search_countdown = 0;
 }
 
 void TimestampEstimator::resetBaseTime(double new_value, double reset_time)
@@ -417,16 +1054,23 @@ void TimestampEstimator::resetBaseTime(double new_value, double reset_time)
     m_last = new_value;
     m_base_time_reset = reset_time;
     if (!m_last_reference.isNull())
-        updateReference(m_last_reference);
+        updateLatency(m_last_reference);
 }
 
 void TimestampEstimator::updateLoss()
 {
     m_expected_losses++;
     m_expected_loss_timeout = 10;
+    publishStatus();
 }
 
 void TimestampEstimator::updateReference(base::Time ts)
+{
+    updateLatency(ts);
+    publishStatus();
+}
+
+void TimestampEstimator::updateLatency(base::Time ts)
 {
     if (!m_got_full_window)
 	return;
@@ -457,22 +1101,29 @@ bool TimestampEstimator::haveEstimate() const
 }
 
 base::Time TimestampEstimator::update(base::Time time, int64_t index)
+{
+    updateIndex(index);
+    return update(time);
+}
+
+void TimestampEstimator::updateIndex(int64_t index)
 {
     if (!m_have_last_index || index <= m_last_index)
     {
 	m_have_last_index = true;
         m_last_index = index;
-        return update(time);
+        return;
     }
 
     int64_t lost = index - m_last_index - 1;
     m_last_index = index;
-    while(lost > 0)
+    if (lost > 0)
     {
-	lost--;
-	updateLoss();
+        // Same as calling updateLoss() lost times, without publishing the
+        // status each time
+        m_expected_losses += lost;
+        m_expected_loss_timeout = 10;
     }
-    return update(time);
 }
 
 base::Time TimestampEstimator::getLatency() const
@@ -480,16 +1131,111 @@ base::Time TimestampEstimator::getLatency() const
     return base::Time::fromSeconds(m_latency);
 }
 
+bool TimestampEstimator::isOutlier(double current, double period) const
+{
+    // Announced losses make samples late on purpose
+    if (m_expected_losses > 0)
+        return false;
+    if (m_jitter_deviation.getCount() < OUTLIER_MIN_SAMPLES)
+        return false;
+
+    // The jitter is only positive, and so are outliers: a sample that is
+    // early compared to the estimate is a better base time
+    double deviation = std::max(m_jitter_deviation.getQuantile(), period * OUTLIER_MIN_DEVIATION);
+    double jitter = current - (m_last + period);
+    return jitter > m_jitter_median.getQuantile() + m_outlier_threshold * deviation;
+}
+
+void TimestampEstimator::setOutlierRejection(double threshold, int max_consecutive)
+{
+    m_outlier_threshold = threshold;
+    m_max_consecutive_outliers = max_consecutive;
+    m_jitter_median.reset();
+    m_jitter_deviation.reset();
+    m_pending_outliers.clear();
+    m_outliers_suspended = false;
+}
+
+double TimestampEstimator::getOutlierThreshold() const
+{
+    return m_outlier_threshold;
+}
+
+int TimestampEstimator::getOutlierCount() const
+{
+    return m_outliers_total;
+}
+
+base::Time TimestampEstimator::getMaxJitter() const
+{
+    return base::Time::fromSeconds(m_max_jitter);
+}
+
+void TimestampEstimator::setJitterQuantile(double quantile)
+{
+    m_jitter.reset(quantile);
+}
+
+double TimestampEstimator::getJitterQuantile() const
+{
+    return m_jitter.getTargetQuantile();
+}
+
+double TimestampEstimator::getNextBaseTime(int n) const
+{
+    double period = getPeriodInternal();
+    double next = m_last + n * period;
+
+    // With a drifting period, the period grows by period_rate at each of
+    // the n samples
+    double fit_period, period_rate;
+    if (m_period_estimation == PERIOD_DRIFT && m_fit_count >= DRIFT_MIN_SAMPLES &&
+            getDriftFit(m_samples.size() - 1, fit_period, period_rate) && fit_period > 0)
+        next += period_rate * n * (n + 1) / 2;
+    return next;
+}
+
+base::Time TimestampEstimator::predictNext(int n) const
+{
+    if (!haveEstimate())
+        return base::Time();
+    return base::Time::fromSeconds(getNextBaseTime(n) - m_latency) + m_zero;
+}
+
+base::Time TimestampEstimator::expectedArrival(int n) const
+{
+    if (!haveEstimate())
+        return base::Time();
+    return base::Time::fromSeconds(getNextBaseTime(n)) + m_zero;
+}
+
+bool TimestampEstimator::getArrivalInterval(base::Time& earliest, base::Time& latest, int n) const
+{
+    if (!haveEstimate())
+        return false;
+
+    // Use the maximum until the quantile has observations, i.e. during the
+    // first window and after load()
+    double jitter = m_jitter.getCount() ? m_jitter.getQuantile() : m_max_jitter;
+    double next = getNextBaseTime(n);
+    earliest = base::Time::fromSeconds(next) + m_zero;
+    latest = base::Time::fromSeconds(next + std::max(0.0, jitter)) + m_zero;
+    return true;
+}
+
 TimestampEstimatorStatus TimestampEstimator::getStatus() const
 {
     TimestampEstimatorStatus status;
     status.stamp = base::Time::fromSeconds(m_last - m_latency) + m_zero;
-    status.period = getPeriod();
+    // getPeriod() throws if there are not enough samples yet
+    if ((m_initial_period && !m_got_full_window) || m_samples.size() - m_missing_samples >= 2)
+        status.period = getPeriod();
     status.latency = getLatency();
     status.lost_samples = m_missing_samples;
     status.lost_samples_total = m_missing_samples_total;
     status.expected_losses = m_expected_losses;
     status.rejected_expected_losses = m_rejected_expected_losses;
+    status.outliers_total = m_outliers_total;
     status.window_size = m_samples.size();
     status.window_capacity = m_samples.capacity();
     status.base_time = base::Time::fromSeconds(m_base_time_reset) + m_zero;
@@ -497,12 +1243,177 @@ TimestampEstimatorStatus TimestampEstimator::getStatus() const
     if (m_samples.empty())
         status.time_raw = base::Time();
     else
-        status.time_raw = base::Time::fromSeconds(m_samples.back()) + m_zero;
+        status.time_raw = base::Time::fromMicroseconds(m_samples.back()) + m_zero;
 
     status.reference_time_raw = m_last_reference;
     return status;
 }
 
+void TimestampEstimator::setStatusPublication(bool enable)
+{
+    m_publish_status = enable;
+    publishStatus();
+}
+
+void TimestampEstimator::publishStatus()
+{
+    if (m_publish_status)
+        m_published_status.write(getStatus());
+}
+
+TimestampEstimatorStatus TimestampEstimator::readPublishedStatus() const
+{
+    return m_published_status.read();
+}
+
+void TimestampEstimator::save(std::ostream& stream) const
+{
+    writeValue(stream, STATE_MAGIC);
+    writeValue(stream, STATE_VERSION);
+
+    writeValue<int64_t>(stream, m_zero.toMicroseconds());
+    writeValue<int32_t>(stream, m_period_estimation);
+    writeValue(stream, m_window);
+    writeValue(stream, m_initial_period);
+    writeValue(stream, m_initial_latency);
+    writeValue<int32_t>(stream, m_lost_threshold);
+
+    writeValue(stream, m_last);
+    writeValue(stream, m_latency);
+    writeValue(stream, m_latency_raw);
+    writeValue(stream, m_max_jitter);
+    writeValue(stream, m_base_time_reset);
+    writeValue(stream, m_base_time_reset_offset);
+    writeValue<int64_t>(stream, m_last_reference.toMicroseconds());
+    writeValue<uint8_t>(stream, m_got_full_window);
+    writeValue<int32_t>(stream, m_missing_samples_total);
+    writeValue(stream, m_last_index);
+    writeValue<uint8_t>(stream, m_have_last_index);
+    writeValue<int32_t>(stream, m_expected_losses);
+    writeValue<int32_t>(stream, m_rejected_expected_losses);
+    writeValue<int32_t>(stream, m_expected_loss_timeout);
+
+    writeValue<uint32_t>(stream, m_lost.size());
+    for (size_t i = 0; i < m_lost.size(); ++i)
+        writeValue<int64_t>(stream, m_lost[i]);
+
+    // The missing sample mask is packed, eight samples per byte
+    writeValue<uint32_t>(stream, m_samples.capacity());
+    writeValue<uint32_t>(stream, m_samples.size());
+    for (size_t i = 0; i < m_samples.size(); ++i)
+        writeValue(stream, m_samples[i]);
+    for (size_t i = 0; i < m_samples.size(); i += 8)
+    {
+        uint8_t mask = 0;
+        for (size_t j = i; j < std::min(i + 8, m_samples.size()); ++j)
+            mask |= m_missing_mask[j] << (j - i);
+        writeValue(stream, mask);
+    }
+
+    // Added in version 2
+    writeValue(stream, m_outlier_threshold);
+    writeValue<int32_t>(stream, m_max_consecutive_outliers);
+    writeValue<int32_t>(stream, m_outliers_total);
+}
+
+void TimestampEstimator::load(std::istream& stream)
+{
+    // The state is read into a copy, so that this estimator is left
+    // unchanged if the state turns out to be invalid
+    TimestampEstimator loaded(*this);
+    loaded.loadState(stream);
+    *this = std::move(loaded);
+    publishStatus();
+}
+
+void TimestampEstimator::loadState(std::istream& stream)
+{
+    if (readValue<uint32_t>(stream) != STATE_MAGIC)
+        throw std::runtime_error("invalid timestamp estimator state.");
+    uint32_t version = readValue<uint32_t>(stream);
+    if (version < 1 || version > STATE_VERSION)
+        throw std::runtime_error("unsupported timestamp estimator state version.");
+
+    base::Time zero = base::Time::fromMicroseconds(readValue<int64_t>(stream));
+    int32_t period_estimation = readValue<int32_t>(stream);
+    double window = readValue<double>(stream);
+    double initial_period = readValue<double>(stream);
+    double initial_latency = readValue<double>(stream);
+    int lost_threshold = readValue<int32_t>(stream);
+    if (period_estimation < PERIOD_FROM_ENDPOINTS || period_estimation > PERIOD_DRIFT)
+        throw std::runtime_error("invalid timestamp estimator state.");
+    // The parameters are checked before internalReset() sizes the sample
+    // window from them
+    if (!std::isfinite(window) || window <= 0 ||
+            !std::isfinite(initial_period) || initial_period < 0)
+        throw std::runtime_error("invalid timestamp estimator state.");
+    if (initial_period && (window + initial_period) / initial_period + 10 > maxSampleCapacity(window))
+        throw std::runtime_error("invalid timestamp estimator state.");
+    internalReset(window, initial_period, initial_latency, lost_threshold);
+    m_zero = zero;
+    m_period_estimation = static_cast<PeriodEstimation>(period_estimation);
+
+    m_last = readValue<double>(stream);
+    m_latency = readValue<double>(stream);
+    m_latency_raw = readValue<double>(stream);
+    m_max_jitter = readValue<double>(stream);
+    m_base_time_reset = readValue<double>(stream);
+    m_base_time_reset_offset = readValue<double>(stream);
+    m_last_reference = base::Time::fromMicroseconds(readValue<int64_t>(stream));
+    m_got_full_window = readValue<uint8_t>(stream);
+    m_missing_samples_total = readValue<int32_t>(stream);
+    m_last_index = readValue<int64_t>(stream);
+    m_have_last_index = readValue<uint8_t>(stream);
+    m_expected_losses = readValue<int32_t>(stream);
+    m_rejected_expected_losses = readValue<int32_t>(stream);
+    m_expected_loss_timeout = readValue<int32_t>(stream);
+
+    // The lost list is not reserved from its unchecked size, so that a
+    // corrupted size fails on the end of the stream instead of allocating
+    size_t lost_size = readValue<uint32_t>(stream);
+    for (size_t i = 0; i < lost_size; ++i)
+        m_lost.push_back(readValue<int64_t>(stream));
+
+    size_t capacity = readValue<uint32_t>(stream);
+    size_t size = readValue<uint32_t>(stream);
+    if (size > capacity || capacity > maxSampleCapacity(m_window))
+        throw std::runtime_error("invalid timestamp estimator state.");
+    std::vector<int64_t> samples(size);
+    for (size_t i = 0; i < size; ++i)
+        samples[i] = readValue<int64_t>(stream);
+
+    // The search structures and the least-squares sums are rebuilt from
+    // the samples
+    setSampleCapacity(capacity);
+    uint8_t mask = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (i % 8 == 0)
+            mask = readValue<uint8_t>(stream);
+        if (mask & (1 << (i % 8)))
+        {
+            pushMissingSample();
+            m_missing_samples++;
+        }
+        else
+            pushSample(samples[i]);
+    }
+    if (!m_samples.empty() && m_missing_mask.front())
+        throw std::runtime_error("invalid timestamp estimator state.");
+
+    if (version >= 2)
+    {
+        m_outlier_threshold = readValue<double>(stream);
+        m_max_consecutive_outliers = readValue<int32_t>(stream);
+        m_outliers_total = readValue<int32_t>(stream);
+    }
+
+    // Keep the converged period for when the saved samples get dropped,
+    // e.g. because the restart took longer than the window
+    if (!m_initial_period && haveEstimate())
+        m_restored_period = getPeriodInternal();
+}
+
 std::ostream& aggregator::operator << (std::ostream& stream, TimestampEstimatorStatus const& status)
 {
     stream << "== Timestamp Estimator Status\n"
@@ -4,8 +4,15 @@
 #include <base/Time.hpp>
 #include <base/CircularBuffer.hpp>
 #include <vector>
+#include <deque>
+#include <iosfwd>
 
 #include <aggregator/TimestampEstimatorStatus.hpp>
+#include <aggregator/Clock.hpp>
+#include <aggregator/LowerEnvelopeQueue.hpp>
+#include <aggregator/SeqLock.hpp>
+#include <aggregator/QuantileEstimator.hpp>
+#include <aggregator/WindowArena.hpp>
 
 namespace aggregator
 {
@@ -14,9 +21,57 @@ namespace aggregator
      *
      * It assumes that most samples will be received at the right period. It
      * will not work if the reception period is completely random.
+     *
+     * update() is amortized O(log n), n being the count of samples in the
+     * window: the window and its gaps are maintained incrementally, and the
+     * base time is searched in a LowerEnvelopeQueue. With PERIOD_DRIFT, the
+     * base time search is a scan of the window, done a fixed number of times
+     * per window.
      */
     class TimestampEstimator
     {
+    public:
+        /** How the period is computed from the samples of the window */
+        enum PeriodEstimation
+        {
+            /** The distance between the first and last valid samples of the
+             * window, divided by the count of periods between them. This is
+             * the default */
+            PERIOD_FROM_ENDPOINTS,
+            /** A least-squares fit of the sample times against their index
+             * in the window. It uses all the valid samples, and is therefore
+             * much less sensitive to the jitter of the samples at both ends
+             * of the window */
+            PERIOD_LEAST_SQUARES,
+            /** A least-squares fit of a period that changes linearly over
+             * time, as with a drifting clock. The period is the one of the
+             * newest samples, instead of the average period over the window
+             */
+            PERIOD_DRIFT
+        };
+
+    private:
+        /** Sum of floating-point values with Kahan compensation, so that
+         * adding and removing values over long periods of time does not
+         * accumulate rounding errors
+         */
+        struct CompensatedSum
+        {
+            double sum;
+            double compensation;
+
+            CompensatedSum()
+                : sum(0), compensation(0) {}
+
+            void add(double value)
+            {
+                double y = value - compensation;
+                double t = sum + y;
+                compensation = (t - sum) - y;
+                sum = t;
+            }
+        };
+
         /** To avoid loss of precision while manipulating doubles, we move all
          * times to be relative to this time
          *
@@ -27,10 +82,101 @@ namespace aggregator
         /** The requested estimation window */
         double m_window;
 
-        /** Set of uncorrected timestamps that is at most m_window large.
-         * Negative values are placeholders for missing samples
+        /** Set of uncorrected timestamps that is at most m_window large,
+         * in microseconds relative to m_zero
+         *
+         * They are stored as integers, as base::Time, so that they do not
+         * lose precision however long the estimator runs. The buffer is on
+         * the heap, unless setSampleStorage() got called
 	 */
-        boost::circular_buffer<double> m_samples;
+        boost::circular_buffer<int64_t, ArenaAllocator<int64_t> > m_samples;
+
+        /** m_missing_mask[i] is true if m_samples[i] is a placeholder for a
+         * missing sample, whose value is meaningless */
+        boost::circular_buffer<bool, ArenaAllocator<bool> > m_missing_mask;
+
+        /** Sequence number of m_samples.front(). Samples are identified by
+         * their sequence number in the structures below, as it does not
+         * change when samples are removed at the front of m_samples
+         */
+        uint64_t m_front_seq;
+
+        /** Count of missing samples at the end of m_samples */
+        unsigned int m_trailing_missing;
+
+        /** The first sample of the window found by the last call to
+         * shortenSampleList, and the start of that window. The samples before
+         * it do not need to be scanned again as long as the window does not
+         * move backward
+         */
+        uint64_t m_window_begin;
+        int64_t m_window_min_time;
+
+        /** The average distance between a valid sample and the next one */
+        struct Gap
+        {
+            uint64_t seq;
+            double gap;
+        };
+
+        /** Gaps between the valid samples up to the beginning of the window,
+         * restricted to the ones that are bigger than all the gaps after
+         * them. It is used by shortenSampleList to find the latest gap that
+         * is bigger than a given size without scanning m_samples
+         */
+        std::deque<Gap> m_gaps;
+
+        /** Sequence number of the first sample that has not been considered
+         * in m_gaps yet */
+        uint64_t m_gaps_end;
+
+        /** Sequence number of the last valid sample considered in m_gaps */
+        uint64_t m_gaps_last_valid;
+        bool m_gaps_have_last_valid;
+
+        /** Lines t - seq * period for each valid sample before the last one
+         * of m_samples, used to find the sample that gives the lowest base
+         * time for a given period
+         */
+        LowerEnvelopeQueue m_base_time_envelope;
+
+        /** Sequence number of the first sample that is not in
+         * m_base_time_envelope yet */
+        uint64_t m_base_time_envelope_end;
+
+        /** Temporary storage for the samples that give the lowest base time,
+         * reused to avoid allocations */
+        std::vector<LowerEnvelopeQueue::Line> m_base_time_candidates;
+
+        /** If set, the results of the searches above are checked against
+         * linear scans of the window, see setSelfCheck() */
+        bool m_self_check;
+
+        /** Temporary storage for the relative times processed by
+         * updateBatch(), reused to avoid allocations */
+        std::vector<int64_t> m_batch;
+
+        /** The method used by getPeriodInternal */
+        PeriodEstimation m_period_estimation;
+
+        /** Running sums over the valid samples of m_samples for the
+         * least-squares fit, k being the index of the sample in m_samples
+         * and t its time. They are updated as samples are added and removed,
+         * so that the fit is O(1) regardless of the window size. They are
+         * not used, and therefore not maintained, with PERIOD_FROM_ENDPOINTS
+         */
+        int m_fit_count;
+        CompensatedSum m_fit_k;
+        CompensatedSum m_fit_kk;
+        CompensatedSum m_fit_kkk;
+        CompensatedSum m_fit_kkkk;
+        CompensatedSum m_fit_t;
+        CompensatedSum m_fit_kt;
+        CompensatedSum m_fit_kkt;
+
+        /** Count of updates until the next base time search of
+         * PERIOD_DRIFT */
+        int m_drift_search_countdown;
 
         /** The last estimated timestamp, without latency
          *
@@ -110,9 +256,48 @@ namespace aggregator
         /** Maximum value taken by the jitter, in seconds */
         double m_max_jitter;
 
+        /** Estimate of a quantile of the jitter, in seconds, used by
+         * getArrivalInterval() */
+        QuantileEstimator m_jitter;
+
+        /** Samples whose jitter is more than this many deviations above the
+         * median jitter are rejected as outliers. Zero if outliers are not
+         * rejected */
+        double m_outlier_threshold;
+
+        /** Maximum count of consecutive samples rejected as outliers */
+        int m_max_consecutive_outliers;
+
+        /** The samples rejected since the last accepted one. If too many
+         * samples get rejected in a row, they are processed again as normal
+         * samples */
+        std::vector<int64_t> m_pending_outliers;
+
+        /** Set when the rejected samples got processed again, until a sample
+         * is received on time. Late samples are not rejected meanwhile, so
+         * that the loss detection can pick them up */
+        bool m_outliers_suspended;
+
+        /** Total count of samples rejected as outliers */
+        int m_outliers_total;
+
+        /** Estimates of the median of the jitter and of the median absolute
+         * deviation from it, used by the outlier rejection */
+        QuantileEstimator m_jitter_median;
+        QuantileEstimator m_jitter_deviation;
+
+        /** Whether a sample received at \c current is rejected as an
+         * outlier, \c period being the current period estimate */
+        bool isOutlier(double current, double period) const;
+
 	/** Initial period used when m_samples is empty */
 	double m_initial_period;
 
+	/** Period estimate restored by load() for an estimator without initial
+	 * period. It becomes the initial period once the restored samples are
+	 * out of the window */
+	double m_restored_period;
+
 	/** Total number of missing samples */
 	int m_missing_samples_total;
 
@@ -128,6 +313,20 @@ namespace aggregator
         /** The last time given to updateReference */
         base::Time m_last_reference;
 
+        /** The clock used by update() when no time is given */
+        ClockPtr m_clock;
+
+        /** If set, the status is published for readPublishedStatus(), see
+         * setStatusPublication() */
+        bool m_publish_status;
+
+        /** Status snapshot for readers in other threads, see
+         * readPublishedStatus() */
+        SeqLock<TimestampEstimatorStatus> m_published_status;
+
+        /** Publishes getStatus() for readPublishedStatus(), if enabled */
+        void publishStatus();
+
         /** The count of samples that are expected to be lost within
          * expected_loss_timeout calls to update().
          */
@@ -143,11 +342,22 @@ namespace aggregator
          */
         int m_expected_loss_timeout;
 
+        /** The expected base time of the n-th next sample, i.e. the time at
+         * which it would be received without jitter, relative to m_zero */
+        double getNextBaseTime(int n) const;
+
+        /** Updates the latency using a reference, without publishing the
+         * status */
+        void updateLatency(base::Time ts);
+
         /** Set the base time to the given value. reset_time is used in update()
          * to trigger new updates when necessary
          */
         void resetBaseTime(double new_value, double reset_time);
 
+        /** Reads a state written by save(), see load() */
+        void loadState(std::istream& stream);
+
         /** Internal helper for the reset() methods, that take double directly.
          * This avoid converting the internal parameters to base::Time and then
          * to double again.
@@ -157,11 +367,118 @@ namespace aggregator
 			   double min_latency,
 			   int lost_threshold = 2);
 
+        /** Updates the estimate with a time relative to m_zero, in
+         * microseconds, and returns the estimated time relative to m_zero in
+         * seconds */
+        double updateInternal(int64_t current);
+
+        /** Updates the estimate with a sample that passed the outlier
+         * rejection. Same arguments and return value as updateInternal */
+        double updateSample(int64_t current);
+
+        /** Handles the index given to update(base::Time, int64_t), announcing
+         * the samples lost since the last index */
+        void updateIndex(int64_t index);
+
         /** Internal method that pushes a new sample on m_samples while making
-         * sure that internal constraints are met (as e.g. that there are no NaN
-         * at the beginning of the buffer)
+         * sure that internal constraints are met (as e.g. that there are no
+         * missing samples at the beginning of the buffer)
+         */
+        void pushSample(int64_t time);
+
+        /** Pushes a placeholder for a missing sample on m_samples */
+        void pushMissingSample();
+
+        /** Makes sure that m_samples has the capacity for a new sample */
+        void reserveSample();
+
+        /** Changes the capacity of m_samples and m_missing_mask */
+        void setSampleCapacity(size_t capacity);
+
+        /** Removes the last sample of m_samples */
+        void popSample();
+
+        /** Removes the given count of samples at the front of m_samples */
+        void eraseSamples(size_t count);
+
+        /** Removes all samples */
+        void clearSamples();
+
+        /** Adds (sign = 1) or removes (sign = -1) the sample at index k of
+         * m_samples from the least-squares sums */
+        void updateFit(double k, double time, int sign);
+
+        /** Updates the least-squares sums after \c count samples got removed
+         * at the front of m_samples */
+        void shiftFit(double count);
+
+        /** Resets the least-squares sums */
+        void clearFit();
+
+        /** Computes the least-squares sums from the samples of the window */
+        void rebuildFit();
+
+        /** Computes the least-squares fit time = offset + k * period of the
+         * valid samples of m_samples, k being the index of the sample in
+         * m_samples
+         *
+         * @return false if there are less than two valid samples
+         */
+        bool getLeastSquaresFit(double& period, double& offset) const;
+
+        /** Computes the least-squares fit of a second-order polynomial of k
+         * to the valid samples of m_samples, and returns the period between
+         * the samples at index k - 1 and k, as well as the change of period
+         * between two consecutive samples
+         *
+         * @return false if there are less than three valid samples
+         */
+        bool getDriftFit(double k, double& period, double& period_rate) const;
+
+        /** The second-order fit of the sample times as a function of
+         * their index k in m_samples. It is expressed relative to the mean
+         * of k so that it is well conditioned */
+        struct DriftModel
+        {
+            double mean_k;
+            double mean_t;
+            /** the variance of k */
+            double m2;
+            double b;
+            double c;
+
+            /** The fitted time of the sample at index k */
+            double at(double k) const
+            {
+                double d = k - mean_k;
+                return mean_t + b * d + c * (d * d - m2);
+            }
+        };
+
+        /** Computes the DriftModel of the valid samples
+         *
+         * @return false if there are less than three valid samples
          */
-        void pushSample(double time);
+        bool getDriftModel(DriftModel& model) const;
+
+        /** The sample with the given sequence number */
+        int64_t getSample(uint64_t seq) const { return m_samples[seq - m_front_seq]; }
+
+        /** Whether the sample with the given sequence number is missing */
+        bool isMissing(uint64_t seq) const { return m_missing_mask[seq - m_front_seq]; }
+
+        /** Checks the start of the window found by shortenSampleList()
+         * against a scan of the samples before \c window_begin, see
+         * setSelfCheck() */
+        void checkWindowStart(uint64_t window_begin, int64_t min_time, double period, uint64_t result) const;
+
+        /** Checks the base time found with m_base_time_envelope against a
+         * scan of the window, see setSelfCheck() */
+        void checkBaseTime(double period, double base_time, double base_time_reset) const;
+
+        /** Adds the gaps between the samples up to \c window_begin to m_gaps
+         */
+        void updateGaps(uint64_t window_begin);
 
     public:
         /** Creates a timestamp estimator
@@ -222,14 +539,58 @@ namespace aggregator
 			   base::Time min_latency,
 			   int lost_threshold = 2);
 
-        /** Updates the estimate and return the actual timestamp for +ts+ */
+        /** Updates the estimate and return the actual timestamp for +ts+
+         *
+         * It is amortized O(log n), n being the count of samples in the
+         * window
+         */
         base::Time update(base::Time ts);
 
+        /** Updates the estimate for a sample received now, as given by the
+         * estimator's clock, and return its actual timestamp
+         */
+        base::Time update();
+
+        /** Sets the clock used by update() without argument. It is
+         * Clock::getSystemClock() by default
+         */
+        void setClock(ClockPtr clock);
+
+        /** Sets how the period is computed from the samples of the window.
+         * It can be changed at any time, and is kept by reset()
+         */
+        void setPeriodEstimation(PeriodEstimation mode);
+
+        /** How the period is computed from the samples of the window */
+        PeriodEstimation getPeriodEstimation() const;
+
         /** Updates the estimate and return the actual timestamp for +ts+,
 	 *  calculating lost samples from the index
 	 */
 	base::Time update(base::Time ts, int64_t index);
 
+        /** Updates the estimate with \c count samples, and writes their actual
+         * timestamps in \c result
+         *
+         * The results are identical to calling update() on each sample in
+         * turn. This is a convenience to process whole logs: the estimation
+         * is sequential, so that the batch is not significantly faster than
+         * update() with the default settings. If the status publication is
+         * enabled, the status gets published once per chunk of samples
+         * instead of once per sample (see the timestamp_estimator results of
+         * streamaligner-benchmark). \c result may be the same array as \c
+         * times
+         */
+        void updateBatch(base::Time const* times, base::Time* result, size_t count);
+
+        /** Updates the estimate with \c count samples and their indexes, and
+         * writes their actual timestamps in \c result
+         *
+         * The results are identical to calling update(base::Time, int64_t) on
+         * each sample in turn
+         */
+        void updateBatch(base::Time const* times, int64_t const* indexes, base::Time* result, size_t count);
+
         /** Updates the estimate for a known lost sample */
 	void updateLoss();
 
@@ -240,6 +601,13 @@ namespace aggregator
          */
         base::Time getPeriod() const;
 
+        /** The currently estimated rate of change of the period, in seconds
+         * per second
+         *
+         * It is only estimated with PERIOD_DRIFT, and is zero otherwise
+         */
+        double getPeriodDrift() const;
+
         /** Shortens the sample list so that the addition of \c time would not
          * overflow the window. Calling this is strongly recommended if there is
          * a chance of only calling updateLoss for long stretches of time
@@ -263,6 +631,65 @@ namespace aggregator
          */
         base::Time getMaxJitter() const;
 
+        /** Sets the quantile of the observed jitter used as the upper bound
+         * of getArrivalInterval(). The default is 0.99. It is kept by reset(),
+         * but the jitter observed so far is discarded
+         */
+        void setJitterQuantile(double quantile);
+        double getJitterQuantile() const;
+
+        /** The estimated timestamp of the n-th sample after the last one
+         * given to update(), i.e. the value update() would return for it
+         * if it was received without jitter
+         *
+         * Lost samples count, i.e. n = 2 is the sample after the next one.
+         * Returns a null time if there is no estimate yet
+         */
+        base::Time predictNext(int n = 1) const;
+
+        /** The earliest time at which the n-th next sample is expected to be
+         * given to update(), i.e. predictNext(n) plus the latency
+         *
+         * Returns a null time if there is no estimate yet
+         */
+        base::Time expectedArrival(int n = 1) const;
+
+        /** The interval in which the n-th next sample is expected to be given
+         * to update(). \c earliest is expectedArrival(n), and \c latest
+         * adds the quantile of the observed jitter set with
+         * setJitterQuantile()
+         *
+         * @return false if there is no estimate yet, in which case the
+         *   arguments are not changed
+         */
+        bool getArrivalInterval(base::Time& earliest, base::Time& latest, int n = 1) const;
+
+        /** Enables the rejection of outliers, i.e. of samples that are much
+         * more delayed than usual, e.g. by a scheduler hiccup
+         *
+         * A sample is rejected if its jitter is more than \c threshold times
+         * the median absolute deviation of the jitter above its median. It
+         * is stamped as if it had no jitter, but is not added to the window
+         * and does not count for the loss detection. The statistics of the
+         * jitter are gathered once the first window is full.
+         *
+         * At most \c max_consecutive samples in a row are rejected. If the
+         * next sample is late as well, the stream changed persistently (e.g.
+         * samples got lost, which makes all the following samples late), and
+         * the rejected samples are processed again as normal samples. Only
+         * their stamps, which are already returned, are wrong. Samples are
+         * never rejected while losses announced with updateLoss() are
+         * pending.
+         *
+         * Set \c threshold to zero to disable, which is the default. It is
+         * kept by reset()
+         */
+        void setOutlierRejection(double threshold, int max_consecutive = 2);
+        double getOutlierThreshold() const;
+
+        /** The total count of samples rejected as outliers */
+        int getOutlierCount() const;
+
         /** Returns a data structure that represents the estimator's internal
          * status
          *
@@ -270,9 +697,74 @@ namespace aggregator
          */
         TimestampEstimatorStatus getStatus() const;
 
+        /** Makes update(), updateBatch(), updateLoss(), updateReference(),
+         * reset() and load() publish the status for readPublishedStatus()
+         *
+         * Publishing costs a getStatus() call, including a period estimate,
+         * and a copy of the whole status at each update. Disabled by default,
+         * kept by reset()
+         */
+        void setStatusPublication(bool enable);
+
+        /** Returns the status as of the end of the last call to update(),
+         * updateBatch(), updateLoss(), updateReference(), reset() or load()
+         * since setStatusPublication() got enabled, or a default status
+         * before that
+         *
+         * Unlike getStatus(), this can be called from any number of other
+         * threads while the estimator is being updated. It never throws, and
+         * does not delay the thread that updates the estimator.
+         */
+        TimestampEstimatorStatus readPublishedStatus() const;
+
         /** Dumps part of the estimator's internal state to std::cout
          */
         void dumpInternalState() const;
+
+        /** Makes update() check the results of its incremental searches
+         * against linear scans of the window, and throw std::logic_error if
+         * they differ. This is meant for tests, as it makes update()
+         * O(window). Disabled by default, kept by reset()
+         */
+        void setSelfCheck(bool enable);
+
+        /** Places the sample window in the given slots of a larger
+         * allocation, e.g. the one shared by the estimators of a
+         * TimestampEstimatorBank. The current samples are kept
+         *
+         * The window moves to the heap while it does not fit in its slot,
+         * e.g. while it grows without an initial period. Copies of this
+         * estimator refer to the same slots, and use the heap while this
+         * estimator uses them.
+         */
+        void setSampleStorage(std::shared_ptr<ArenaSlot> const& samples,
+                std::shared_ptr<ArenaSlot> const& missing_mask);
+
+        /** Writes the estimator's state in a compact binary form, to be
+         * restored with load()
+         *
+         * The state contains the parameters, the estimates (period, base
+         * time, latency) and the samples of the window. Values are written
+         * in the host's byte order. The clock is not saved.
+         */
+        void save(std::ostream& stream) const;
+
+        /** Restores a state written by save(), e.g. to warm-start a restarted
+         * driver
+         *
+         * The estimator then behaves as the saved one would have. In
+         * particular, updateReference() works right away if the saved
+         * estimator had a full window. The only difference is when all the
+         * restored samples get out of the window, e.g. because the restart
+         * took longer than the window: if the saved estimator had no initial
+         * period, its period estimate is then used as the initial period,
+         * so that the estimate stays converged.
+         *
+         * The estimator is left unchanged if an exception is thrown.
+         *
+         * @throws std::runtime_error if the data is not a valid state
+         */
+        void load(std::istream& stream);
     };
 }
 
@@ -0,0 +1,223 @@
+#include "TimestampEstimatorBank.hpp"
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+using namespace aggregator;
+
+TimestampEstimatorBank::TimestampEstimatorBank(size_t channels, TimestampEstimator const& prototype)
+    : estimators(channels, prototype)
+    , generation(0)
+    , pending(0)
+    , stopping(false)
+{
+    packWindows();
+}
+
+TimestampEstimatorBank::~TimestampEstimatorBank()
+{
+    stopWorkers();
+}
+
+void TimestampEstimatorBank::resize(size_t channels, TimestampEstimator const& prototype)
+{
+    estimators.resize(channels, prototype);
+    packWindows();
+}
+
+void TimestampEstimatorBank::packWindows()
+{
+    // Each window's samples are followed by its missing sample mask. The
+    // offsets are kept aligned for the samples
+    const size_t alignment = sizeof(int64_t);
+    std::vector<size_t> capacities(estimators.size());
+    size_t total = 0;
+    for (size_t i = 0; i < estimators.size(); ++i)
+    {
+        capacities[i] = estimators[i].getStatus().window_capacity;
+        total += capacities[i] * sizeof(int64_t);
+        total += (capacities[i] * sizeof(bool) + alignment - 1) / alignment * alignment;
+    }
+
+    std::shared_ptr<char> storage(new char[total], std::default_delete<char[]>());
+    size_t offset = 0;
+    for (size_t i = 0; i < estimators.size(); ++i)
+    {
+        size_t samples_size = capacities[i] * sizeof(int64_t);
+        size_t mask_size = capacities[i] * sizeof(bool);
+        std::shared_ptr<ArenaSlot> samples(new ArenaSlot(storage, offset, samples_size));
+        offset += samples_size;
+        std::shared_ptr<ArenaSlot> mask(new ArenaSlot(storage, offset, mask_size));
+        offset += (mask_size + alignment - 1) / alignment * alignment;
+        estimators[i].setSampleStorage(samples, mask);
+    }
+}
+
+TimestampEstimator& TimestampEstimatorBank::getEstimator(size_t channel)
+{
+    if (channel >= estimators.size())
+        throw std::runtime_error("invalid channel index.");
+    return estimators[channel];
+}
+
+TimestampEstimator const& TimestampEstimatorBank::getEstimator(size_t channel) const
+{
+    if (channel >= estimators.size())
+        throw std::runtime_error("invalid channel index.");
+    return estimators[channel];
+}
+
+void TimestampEstimatorBank::reset()
+{
+    for (size_t i = 0; i < estimators.size(); ++i)
+        estimators[i].reset();
+}
+
+void TimestampEstimatorBank::setThreadCount(size_t threads)
+{
+    stopWorkers();
+    for (size_t t = 0; t + 1 < threads; ++t)
+        workers.push_back(std::thread(&TimestampEstimatorBank::run, this, t, generation));
+}
+
+void TimestampEstimatorBank::stopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start_condition.notify_all();
+    for (size_t t = 0; t < workers.size(); ++t)
+        workers[t].join();
+    workers.clear();
+    stopping = false;
+}
+
+void TimestampEstimatorBank::run(size_t thread, uint64_t seen)
+{
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_condition.wait(lock, [this, seen]() { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+        }
+
+        updatePartition(thread);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0)
+            done_condition.notify_one();
+    }
+}
+
+base::Time TimestampEstimatorBank::update(size_t channel, base::Time time)
+{
+    return getEstimator(channel).update(time);
+}
+
+void TimestampEstimatorBank::update(size_t const* channels, base::Time const* times,
+        base::Time* result, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (channels[i] >= estimators.size())
+            throw std::runtime_error("invalid channel index.");
+    }
+
+    if (workers.empty())
+    {
+        for (size_t i = 0; i < count; ++i)
+            result[i] = estimators[channels[i]].update(times[i]);
+        return;
+    }
+
+    partition(channels, times, count);
+    errors.assign(workers.size() + 1, std::exception_ptr());
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = workers.size();
+        ++generation;
+    }
+    start_condition.notify_all();
+
+    updatePartition(workers.size());
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_condition.wait(lock, [this]() { return pending == 0; });
+    }
+
+    for (size_t t = 0; t < errors.size(); ++t)
+    {
+        if (errors[t])
+            std::rethrow_exception(errors[t]);
+    }
+    for (size_t i = 0; i < count; ++i)
+        result[sorted_indexes[i]] = sorted_results[i];
+}
+
+void TimestampEstimatorBank::partition(size_t const* channels, base::Time const* times, size_t count)
+{
+    size_t threads = workers.size() + 1;
+    channel_counts.assign(estimators.size(), 0);
+    for (size_t i = 0; i < count; ++i)
+        channel_counts[channels[i]]++;
+
+    // Turn the counts into the position of the first sample of each
+    // channel, the channels being sorted in order. A thread moves to the
+    // next range of channels once it got its share of the samples
+    thread_begin.assign(threads + 1, count);
+    thread_begin[0] = 0;
+    size_t thread = 0;
+    size_t position = 0;
+    for (size_t c = 0; c < estimators.size(); ++c)
+    {
+        while (thread + 1 < threads && position >= count * (thread + 1) / threads)
+            thread_begin[++thread] = position;
+
+        size_t channel_count = channel_counts[c];
+        channel_counts[c] = position;
+        position += channel_count;
+    }
+
+    // Stable sort of the samples by channel, which keeps the order of the
+    // samples of a given channel
+    sorted_indexes.resize(count);
+    sorted_channels.resize(count);
+    sorted_times.resize(count);
+    sorted_results.resize(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t sorted = channel_counts[channels[i]]++;
+        sorted_indexes[sorted] = i;
+        sorted_channels[sorted] = channels[i];
+        sorted_times[sorted] = times[i];
+    }
+}
+
+void TimestampEstimatorBank::updatePartition(size_t thread)
+{
+    try
+    {
+        for (size_t i = thread_begin[thread]; i < thread_begin[thread + 1]; ++i)
+            sorted_results[i] = estimators[sorted_channels[i]].update(sorted_times[i]);
+    }
+    catch (...)
+    {
+        errors[thread] = std::current_exception();
+    }
+}
+
+TimestampEstimatorStatus TimestampEstimatorBank::getStatus(size_t channel) const
+{
+    return getEstimator(channel).getStatus();
+}
+
+void TimestampEstimatorBank::getStatus(std::vector<TimestampEstimatorStatus>& result) const
+{
+    result.resize(estimators.size());
+    for (size_t i = 0; i < estimators.size(); ++i)
+        result[i] = estimators[i].getStatus();
+}
@@ -0,0 +1,142 @@
+#ifndef AGGREGATOR_TIMESTAMP_ESTIMATOR_BANK_HPP
+#define AGGREGATOR_TIMESTAMP_ESTIMATOR_BANK_HPP
+
+#include <aggregator/TimestampEstimator.hpp>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace aggregator
+{
+    /** A set of timestamp estimators, e.g. one per channel of a device
+     *
+     * update() processes samples of many channels at once. The channels
+     * can be spread over several threads (see setThreadCount()), each
+     * thread handling a contiguous range of channels. The samples of a
+     * given channel are always processed in the order in which they are
+     * given.
+     *
+     * The bank holds one TimestampEstimator object per channel. The sample
+     * windows of all channels are placed in a single allocation (see
+     * packWindows()), instead of one heap allocation per channel.
+     */
+    class TimestampEstimatorBank
+    {
+    public:
+        /** Creates a bank of \c channels estimators, all copies of \c
+         * prototype
+         *
+         * Use getEstimator() to configure channels individually
+         */
+        explicit TimestampEstimatorBank(size_t channels = 0,
+                TimestampEstimator const& prototype = TimestampEstimator());
+        ~TimestampEstimatorBank();
+
+        TimestampEstimatorBank(TimestampEstimatorBank const&) = delete;
+        TimestampEstimatorBank& operator=(TimestampEstimatorBank const&) = delete;
+
+        /** Changes the count of channels. The estimators of the new
+         * channels are copies of \c prototype. The windows get packed again
+         */
+        void resize(size_t channels,
+                TimestampEstimator const& prototype = TimestampEstimator());
+
+        /** Moves the sample windows of all channels into a new single
+         * allocation, each window getting a slot sized for its current
+         * capacity
+         *
+         * It is done on construction and by resize(). Estimators without an
+         * initial period start with a small window, which moves to the heap
+         * as it grows; call this again once their window got full. The
+         * windows of estimators that get load()ed or reconfigured with a
+         * larger capacity move to the heap as well.
+         */
+        void packWindows();
+
+        /** The count of channels */
+        size_t size() const { return estimators.size(); }
+
+        /** The estimator of the given channel */
+        TimestampEstimator& getEstimator(size_t channel);
+        TimestampEstimator const& getEstimator(size_t channel) const;
+
+        /** Resets the estimators of all channels */
+        void reset();
+
+        /** Sets the count of threads used by update(), including the
+         * calling thread. The default is 1, i.e. update() runs in the
+         * calling thread only. The other threads are started here, and
+         * wait for the next update() call between calls
+         */
+        void setThreadCount(size_t threads);
+        size_t getThreadCount() const { return workers.size() + 1; }
+
+        /** Updates the estimate of a single channel and returns the actual
+         * timestamp of \c time
+         */
+        base::Time update(size_t channel, base::Time time);
+
+        /** Updates the estimates with \c count samples, the sample \c i
+         * being received on channel \c channels[i] at \c times[i]. Its
+         * actual timestamp is written in \c result[i]
+         *
+         * The results are identical to calling update(channel, time) for
+         * each sample in turn. With several threads, the samples are first
+         * sorted by channel, so that each thread reads and writes its own
+         * contiguous ranges, and the results are copied back in \c result
+         * at the end
+         */
+        void update(size_t const* channels, base::Time const* times,
+                base::Time* result, size_t count);
+
+        /** The status of the given channel's estimator */
+        TimestampEstimatorStatus getStatus(size_t channel) const;
+
+        /** Fills \c result with the status of every channel's estimator */
+        void getStatus(std::vector<TimestampEstimatorStatus>& result) const;
+
+    private:
+        /** Sorts the samples by channel in the sorted_* arrays, and assigns
+         * a contiguous range of channels to each thread, so that the
+         * threads get about the same count of samples */
+        void partition(size_t const* channels, base::Time const* times, size_t count);
+
+        /** Updates the estimators with the samples of the given thread */
+        void updatePartition(size_t thread);
+
+        /** Main loop of the worker threads */
+        void run(size_t thread, uint64_t generation);
+
+        void stopWorkers();
+
+        std::vector<TimestampEstimator> estimators;
+
+        /** The threads other than the one calling update(). The calling
+         * thread handles the last partition */
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable start_condition;
+        std::condition_variable done_condition;
+        /** Incremented for each update() call handed to the workers */
+        uint64_t generation;
+        /** Count of workers that did not finish the current call */
+        size_t pending;
+        bool stopping;
+
+        /** Count of samples of each channel in the current call, then the
+         * position of its next sample in the sorted_* arrays */
+        std::vector<size_t> channel_counts;
+        /** The samples of the current call sorted by channel. The ones of
+         * thread \c i are in [thread_begin[i], thread_begin[i + 1]) */
+        std::vector<size_t> thread_begin;
+        std::vector<size_t> sorted_indexes;
+        std::vector<size_t> sorted_channels;
+        std::vector<base::Time> sorted_times;
+        std::vector<base::Time> sorted_results;
+        std::vector<std::exception_ptr> errors;
+    };
+}
+
+#endif
@@ -28,7 +28,8 @@ namespace aggregator {
         /** Total count of lost samples
          */
         int lost_samples_total;
-        /** Count of lost samples currently stored in the estimator
+        /** Count of lost samples currently stored in the estimator,
+         * including the samples rejected as outliers
          */
         int lost_samples;
         /** Count of samples currently stored in the estimator
@@ -51,6 +52,10 @@ namespace aggregator {
          * the estimator
          */
         int rejected_expected_losses;
+        /** Count of samples rejected as outliers, see
+         * TimestampEstimator::setOutlierRejection
+         */
+        int outliers_total;
 
         TimestampEstimatorStatus()
             : lost_samples(0) {}
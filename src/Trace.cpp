@@ -0,0 +1,195 @@
+#include "Trace.hpp"
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace aggregator;
+
+namespace
+{
+    struct Event
+    {
+        const char *name;
+        char phase;
+        int stream;
+        /** CLOCK_MONOTONIC time in nanoseconds */
+        int64_t time;
+    };
+
+    /** An event in a ring buffer
+     *
+     * The slot is protected by a sequence number, as in SeqLock, so that
+     * dump() can read it while the owning thread overwrites it. The sequence
+     * number is 2 * index + 2 once the event of the given index is written,
+     * and odd while it gets written. The fields are atomics accessed with
+     * relaxed ordering, so that concurrent accesses are not data races */
+    struct Slot
+    {
+        Slot() : sequence(0), name(0), phase(0), stream(0), time(0) {}
+
+        std::atomic<uint64_t> sequence;
+        std::atomic<const char*> name;
+        std::atomic<char> phase;
+        std::atomic<int> stream;
+        std::atomic<int64_t> time;
+
+        void write(uint64_t index, Event const& event)
+        {
+            sequence.store(2 * index + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            name.store(event.name, std::memory_order_relaxed);
+            phase.store(event.phase, std::memory_order_relaxed);
+            stream.store(event.stream, std::memory_order_relaxed);
+            time.store(event.time, std::memory_order_relaxed);
+            sequence.store(2 * index + 2, std::memory_order_release);
+        }
+
+        /** Reads the event of the given index. Returns false if the slot
+         * does not hold it (anymore) */
+        bool read(uint64_t index, Event& event) const
+        {
+            uint64_t seq = sequence.load(std::memory_order_acquire);
+            if (seq != 2 * index + 2)
+                return false;
+            event.name = name.load(std::memory_order_relaxed);
+            event.phase = phase.load(std::memory_order_relaxed);
+            event.stream = stream.load(std::memory_order_relaxed);
+            event.time = time.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return sequence.load(std::memory_order_relaxed) == seq;
+        }
+    };
+
+    /** Ring buffer of the events of a single thread. It is only written by
+     * that thread */
+    struct ThreadBuffer
+    {
+        ThreadBuffer(int thread_id, size_t size)
+            : thread_id(thread_id), events(size), head(0) {}
+
+        int thread_id;
+        std::vector<Slot> events;
+        /** count of events ever written */
+        std::atomic<uint64_t> head;
+    };
+
+    struct Registry
+    {
+        Registry() : buffer_size(65536) {}
+
+        std::mutex mutex;
+        size_t buffer_size;
+        /** the buffers are kept after their thread exits, so that their
+         * events can still be dumped */
+        std::vector< boost::shared_ptr<ThreadBuffer> > buffers;
+    };
+
+    Registry &getRegistry()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    thread_local ThreadBuffer *thread_buffer = 0;
+
+    ThreadBuffer *createThreadBuffer()
+    {
+        Registry &registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        boost::shared_ptr<ThreadBuffer> buffer(new ThreadBuffer(registry.buffers.size() + 1, registry.buffer_size));
+        registry.buffers.push_back(buffer);
+        return buffer.get();
+    }
+
+    int64_t now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+}
+
+void trace::record(const char *name, Phase phase, int stream)
+{
+    ThreadBuffer *buffer = thread_buffer;
+    if (!buffer)
+        buffer = thread_buffer = createThreadBuffer();
+    if (buffer->events.empty())
+        return;
+
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    Event event = { name, static_cast<char>(phase), stream, now() };
+    buffer->events[head % buffer->events.size()].write(head, event);
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+void trace::setBufferSize(size_t events)
+{
+    Registry &registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.buffer_size = events;
+}
+
+void trace::clear()
+{
+    Registry &registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (size_t i = 0; i < registry.buffers.size(); ++i)
+        registry.buffers[i]->head.store(0, std::memory_order_release);
+}
+
+void trace::dump(std::ostream &out)
+{
+    Registry &registry = getRegistry();
+    std::vector< boost::shared_ptr<ThreadBuffer> > buffers;
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        buffers = registry.buffers;
+    }
+
+    int pid = getpid();
+    bool first = true;
+    out << "{\"traceEvents\":[";
+    for (size_t i = 0; i < buffers.size(); ++i)
+    {
+        const ThreadBuffer &buffer = *buffers[i];
+        uint64_t size = buffer.events.size();
+        uint64_t head = buffer.head.load(std::memory_order_acquire);
+        uint64_t begin = head > size ? head - size : 0;
+        for (uint64_t index = begin; index < head; ++index)
+        {
+            // Skip the events that got overwritten since head got read
+            Event event;
+            if (!buffer.events[index % size].read(index, event))
+                continue;
+            out << (first ? "\n" : ",\n")
+                << "{\"name\":\"" << event.name << "\""
+                << ",\"ph\":\"" << event.phase << "\""
+                << ",\"ts\":" << event.time / 1000 << "." << (event.time % 1000) / 100 << (event.time % 100) / 10 << event.time % 10
+                << ",\"pid\":" << pid
+                << ",\"tid\":" << buffer.thread_id;
+            if (event.phase == INSTANT)
+                out << ",\"s\":\"t\"";
+            if (event.stream >= 0)
+                out << ",\"args\":{\"stream\":" << event.stream << "}";
+            out << "}";
+            first = false;
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+bool trace::dump(const std::string &path)
+{
+    std::ofstream out(path.c_str());
+    if (!out)
+        return false;
+    dump(out);
+    return static_cast<bool>(out);
+}
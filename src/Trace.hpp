@@ -0,0 +1,77 @@
+#ifndef AGGREGATOR_TRACE_HPP
+#define AGGREGATOR_TRACE_HPP
+
+#include <iosfwd>
+#include <string>
+#include <stddef.h>
+
+namespace aggregator
+{
+    /** Recording of the stream aligner's activity, for inspection in
+     * chrome://tracing or Perfetto
+     *
+     * Events are recorded in a ring buffer per thread, so that recording
+     * does not take locks. When a ring buffer is full, its oldest events
+     * are overwritten.
+     *
+     * The stream aligner only records events if the code using it is built
+     * with AGGREGATOR_TRACING defined (see the AGGREGATOR_TRACING CMake
+     * option). Otherwise, the AGGREGATOR_TRACE_* macros expand to nothing.
+     */
+    namespace trace
+    {
+        enum Phase
+        {
+            BEGIN = 'B',
+            END = 'E',
+            INSTANT = 'i'
+        };
+
+        /** Records an event in the ring buffer of the calling thread
+         *
+         * @param name - the event name. It must be a string literal, as
+         *      only the pointer is stored
+         * @param stream - the index of the stream the event relates to, or
+         *      -1
+         */
+        void record(const char *name, Phase phase, int stream);
+
+        /** Sets the count of events kept per thread. It only applies to
+         * threads that did not record any event yet. The default is 65536
+         */
+        void setBufferSize(size_t events);
+
+        /** Removes the recorded events
+         *
+         * It must not be called while events get recorded
+         */
+        void clear();
+
+        /** Writes the recorded events in the Chrome trace event JSON format
+         *
+         * This can be called while other threads record events. Events
+         * recorded during the call may be missing, as well as the events
+         * that get overwritten during the call when a ring buffer wraps
+         * around. The events that are written are always complete.
+         */
+        void dump(std::ostream &out);
+
+        /** Writes the recorded events in the given file. See dump()
+         *
+         * @return false if the file could not be written
+         */
+        bool dump(const std::string &path);
+    }
+}
+
+#ifdef AGGREGATOR_TRACING
+#define AGGREGATOR_TRACE_BEGIN(name, stream) ::aggregator::trace::record(name, ::aggregator::trace::BEGIN, stream)
+#define AGGREGATOR_TRACE_END(name, stream) ::aggregator::trace::record(name, ::aggregator::trace::END, stream)
+#define AGGREGATOR_TRACE_INSTANT(name, stream) ::aggregator::trace::record(name, ::aggregator::trace::INSTANT, stream)
+#else
+#define AGGREGATOR_TRACE_BEGIN(name, stream) do {} while (0)
+#define AGGREGATOR_TRACE_END(name, stream) do {} while (0)
+#define AGGREGATOR_TRACE_INSTANT(name, stream) do {} while (0)
+#endif
+
+#endif
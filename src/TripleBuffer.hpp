@@ -0,0 +1,82 @@
+#ifndef AGGREGATOR_TRIPLE_BUFFER_HPP
+#define AGGREGATOR_TRIPLE_BUFFER_HPP
+
+#include <atomic>
+
+namespace aggregator
+{
+    /** Wait-free exchange of a value between one writer and one reader
+     * thread
+     *
+     * The writer fills the back buffer and publishes it, which swaps it with
+     * the middle buffer. The reader swaps the middle buffer with its front
+     * buffer when a new value got published. Neither side ever waits for the
+     * other, and the reader always sees a complete value.
+     *
+     * Values are copy-assigned into the buffers, so types that keep their
+     * storage on assignment (std::string, std::vector) don't allocate once
+     * the buffers have been filled.
+     */
+    template<typename T>
+    class TripleBuffer
+    {
+    public:
+        TripleBuffer()
+            : state(MIDDLE_INIT), back(BACK_INIT), front(FRONT_INIT), published(false) {}
+
+        /** The buffer the writer should fill before calling publish() */
+        T &getBackBuffer() { return buffers[back]; }
+
+        /** Copies \c value in the back buffer and publishes it */
+        void write(const T &value)
+        {
+            buffers[back] = value;
+            publish();
+        }
+
+        /** Makes the back buffer visible to the reader. Writer side */
+        void publish()
+        {
+            int previous = state.exchange(back | DIRTY, std::memory_order_acq_rel);
+            back = previous & INDEX_MASK;
+            published.store(true, std::memory_order_release);
+        }
+
+        /** Gets the last published value. Reader side
+         *
+         * The reference stays valid until the next call to read()
+         */
+        const T &read()
+        {
+            if (state.load(std::memory_order_relaxed) & DIRTY)
+            {
+                int previous = state.exchange(front, std::memory_order_acq_rel);
+                front = previous & INDEX_MASK;
+            }
+            return buffers[front];
+        }
+
+        /** True if publish() has been called at least once */
+        bool hasValue() const { return published.load(std::memory_order_acquire); }
+
+    private:
+        TripleBuffer(const TripleBuffer&);
+        TripleBuffer &operator=(const TripleBuffer&);
+
+        static const int DIRTY = 4;
+        static const int INDEX_MASK = 3;
+        static const int FRONT_INIT = 0;
+        static const int MIDDLE_INIT = 1;
+        static const int BACK_INIT = 2;
+
+        T buffers[3];
+        /** index of the middle buffer, with the DIRTY flag set if it holds
+         * a value the reader did not get yet */
+        std::atomic<int> state;
+        int back;
+        int front;
+        std::atomic<bool> published;
+    };
+}
+
+#endif
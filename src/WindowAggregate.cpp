@@ -0,0 +1,135 @@
+#include "WindowAggregate.hpp"
+#include <stdexcept>
+#include <base/Float.hpp>
+
+using namespace aggregator;
+
+WindowAggregate::WindowAggregate(base::Time window, size_t dimension)
+{
+    reset(window, dimension);
+}
+
+void WindowAggregate::reset(base::Time window, size_t dimension)
+{
+    this->window = window;
+    this->dimension = dimension;
+    mean.resize(dimension);
+    m2.resize(dimension);
+    min_queues.resize(dimension);
+    max_queues.resize(dimension);
+    clear();
+}
+
+void WindowAggregate::clear()
+{
+    first_seq = 0;
+    times.clear();
+    values.clear();
+    for (size_t i = 0; i < dimension; ++i)
+    {
+        mean[i] = 0;
+        m2[i] = 0;
+        min_queues[i].clear();
+        max_queues[i].clear();
+    }
+}
+
+void WindowAggregate::push(const base::Time &ts, const std::vector<double> &fields)
+{
+    if (fields.size() < dimension)
+        throw std::invalid_argument("WindowAggregate::push: not enough fields in sample");
+
+    if (!window.isNull())
+    {
+        while (!times.empty() && times.front() <= ts - window)
+            removeOldest();
+    }
+
+    uint64_t seq = first_seq + times.size();
+    times.push_back(ts);
+    size_t count = times.size();
+    for (size_t i = 0; i < dimension; ++i)
+    {
+        double x = fields[i];
+        values.push_back(x);
+
+        double delta = x - mean[i];
+        mean[i] += delta / count;
+        m2[i] += delta * (x - mean[i]);
+
+        monotonic_queue &min_q = min_queues[i];
+        while (!min_q.empty() && min_q.back().second >= x)
+            min_q.pop_back();
+        min_q.push_back(std::make_pair(seq, x));
+
+        monotonic_queue &max_q = max_queues[i];
+        while (!max_q.empty() && max_q.back().second <= x)
+            max_q.pop_back();
+        max_q.push_back(std::make_pair(seq, x));
+    }
+}
+
+void WindowAggregate::removeOldest()
+{
+    size_t count = times.size();
+    for (size_t i = 0; i < dimension; ++i)
+    {
+        double x = values.front();
+        values.pop_front();
+
+        if (count == 1)
+        {
+            mean[i] = 0;
+            m2[i] = 0;
+        }
+        else
+        {
+            double delta = x - mean[i];
+            mean[i] -= delta / (count - 1);
+            m2[i] -= delta * (x - mean[i]);
+            // Protect against accumulated rounding errors
+            if (m2[i] < 0)
+                m2[i] = 0;
+        }
+
+        if (min_queues[i].front().first == first_seq)
+            min_queues[i].pop_front();
+        if (max_queues[i].front().first == first_seq)
+            max_queues[i].pop_front();
+    }
+    times.pop_front();
+    first_seq++;
+}
+
+base::Time WindowAggregate::getLatestTime() const
+{
+    if (times.empty())
+        return base::Time();
+    return times.back();
+}
+
+double WindowAggregate::getMean(size_t field) const
+{
+    return mean.at(field);
+}
+
+double WindowAggregate::getVariance(size_t field) const
+{
+    if (times.size() < 2)
+        return 0;
+    return m2.at(field) / (times.size() - 1);
+}
+
+double WindowAggregate::getMin(size_t field) const
+{
+    if (times.empty())
+        return base::unset<double>();
+    return min_queues.at(field).front().second;
+}
+
+double WindowAggregate::getMax(size_t field) const
+{
+    if (times.empty())
+        return base::unset<double>();
+    return max_queues.at(field).front().second;
+}
@@ -0,0 +1,86 @@
+#ifndef AGGREGATOR_WINDOW_AGGREGATE_HPP
+#define AGGREGATOR_WINDOW_AGGREGATE_HPP
+
+#include <base/Time.hpp>
+#include <deque>
+#include <vector>
+#include <stdint.h>
+
+namespace aggregator
+{
+    /** Incremental aggregates over a sliding window of data time
+     *
+     * Every sample is a fixed-size set of scalar fields. For each field, the
+     * mean, variance, minimum and maximum of the samples received during the
+     * last \c window seconds are maintained. Mean and variance are computed
+     * using Welford's algorithm (with removal), minimum and maximum use a
+     * monotonic queue, so that both push() and the queries are amortized O(1).
+     */
+    class WindowAggregate
+    {
+    public:
+        /** Creates an aggregate
+         *
+         * @arg window the length of the window in data time. A null window
+         *        means that samples are never removed.
+         * @arg dimension the number of scalar fields in each sample
+         */
+        explicit WindowAggregate(base::Time window = base::Time(), size_t dimension = 1);
+
+        /** Changes the window parameters and removes all samples */
+        void reset(base::Time window, size_t dimension);
+
+        /** Adds a sample to the window, and removes the ones that got older
+         * than ts - window
+         *
+         * \c fields must have at least getDimension() elements
+         */
+        void push(const base::Time &ts, const std::vector<double> &fields);
+
+        /** Removes all samples from the window */
+        void clear();
+
+        /** The count of samples currently in the window */
+        size_t size() const { return times.size(); }
+        bool empty() const { return times.empty(); }
+
+        base::Time getWindow() const { return window; }
+        size_t getDimension() const { return dimension; }
+
+        /** Time of the newest sample in the window. Null if empty */
+        base::Time getLatestTime() const;
+
+        /** Mean of the given field. Zero if the window is empty */
+        double getMean(size_t field = 0) const;
+        /** Sample variance of the given field. Zero if the window has less
+         * than two samples
+         */
+        double getVariance(size_t field = 0) const;
+        /** Minimum of the given field. NaN if the window is empty */
+        double getMin(size_t field = 0) const;
+        /** Maximum of the given field. NaN if the window is empty */
+        double getMax(size_t field = 0) const;
+
+    private:
+        typedef std::deque< std::pair<uint64_t, double> > monotonic_queue;
+
+        void removeOldest();
+
+        base::Time window;
+        size_t dimension;
+
+        /** Sequence number of the oldest sample in the window */
+        uint64_t first_seq;
+
+        std::deque<base::Time> times;
+        /** The field values, getDimension() values per sample */
+        std::deque<double> values;
+
+        std::vector<double> mean;
+        std::vector<double> m2;
+        std::vector<monotonic_queue> min_queues;
+        std::vector<monotonic_queue> max_queues;
+    };
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef AGGREGATOR_WINDOW_ARENA_HPP
+#define AGGREGATOR_WINDOW_ARENA_HPP
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <stddef.h>
+
+namespace aggregator
+{
+    /** A memory block reserved for one buffer, within an allocation shared
+     * by many buffers (see ArenaAllocator)
+     */
+    struct ArenaSlot
+    {
+        ArenaSlot(std::shared_ptr<char> const& storage, size_t offset, size_t size)
+            : storage(storage)
+            , data(storage.get() + offset)
+            , size(size)
+            , used(false) {}
+
+        /** The shared allocation, which is kept as long as one of its slots
+         * is referred to */
+        std::shared_ptr<char> storage;
+        char* data;
+        size_t size;
+        /** Whether a buffer currently uses the slot. Buffers that share the
+         * slot, e.g. because their container got copied, use the heap
+         * meanwhile */
+        std::atomic<bool> used;
+    };
+
+    /** Allocator that places a container's buffer in an ArenaSlot
+     *
+     * The slot is used if it is free and large enough, and the heap
+     * otherwise. A default-constructed allocator always uses the heap.
+     * Since containers allocate their new buffer before releasing the old
+     * one, a buffer that grows out of the slot moves to the heap, and may
+     * move back to the slot on a later allocation that fits in it.
+     */
+    template<typename T>
+    class ArenaAllocator
+    {
+    public:
+        typedef T value_type;
+
+        template<typename U>
+        struct rebind { typedef ArenaAllocator<U> other; };
+
+        ArenaAllocator() {}
+
+        explicit ArenaAllocator(std::shared_ptr<ArenaSlot> const& slot)
+            : slot(slot) {}
+
+        template<typename U>
+        ArenaAllocator(ArenaAllocator<U> const& other)
+            : slot(other.slot) {}
+
+        T* allocate(size_t n)
+        {
+            if (slot && n * sizeof(T) <= slot->size && !slot->used.exchange(true))
+                return reinterpret_cast<T*>(slot->data);
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T* p, size_t)
+        {
+            if (slot && reinterpret_cast<char*>(p) == slot->data)
+                slot->used.store(false);
+            else
+                ::operator delete(p);
+        }
+
+        template<typename U>
+        bool operator == (ArenaAllocator<U> const& other) const { return slot == other.slot; }
+        template<typename U>
+        bool operator != (ArenaAllocator<U> const& other) const { return slot != other.slot; }
+
+        std::shared_ptr<ArenaSlot> slot;
+    };
+}
+
+#endif
@@ -0,0 +1,393 @@
+/** Throughput and latency benchmark of StreamAligner and TimestampEstimator
+ *
+ * Usage: streamaligner-benchmark [scale]
+ *
+ * Runs a fixed list of scenarios and writes the results as JSON on the
+ * standard output. The scenarios and the key order of the output do not
+ * change between runs, so that results of different commits can be
+ * compared directly. \c scale multiplies the number of samples of every
+ * scenario (default 1.0), e.g. 0.1 for a quick check.
+ *
+ * For each scenario, it reports:
+ *  - ns_per_sample: wall-clock time of push() and step() per sample
+ *  - allocations_per_sample: calls to operator new per sample
+ *  - latency_ns: percentiles of the time taken by a single push() followed
+ *    by the step() calls until step() returns false
+ *
+ * It then re-stamps a log with TimestampEstimator for several window sizes,
+ * and reports the time per sample of update() and of updateBatch(), with
+ * the status publication disabled (the default) and enabled
+ */
+#include <aggregator/StreamAligner.hpp>
+#include <aggregator/TimestampEstimator.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+    size_t allocation_count = 0;
+}
+
+void *operator new(size_t size)
+{
+    ++allocation_count;
+    if (void *ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+using namespace aggregator;
+
+namespace
+{
+    enum Arrival { PERIODIC, BURSTY };
+
+    struct Scenario
+    {
+        int streams;
+        size_t payload_size;
+        Arrival arrival;
+        bool fixed_buffer;
+        /** count of samples at scale 1 */
+        size_t samples;
+    };
+
+    /** the samples pushed to a stream during each burst, in bursty mode */
+    const int BURST_SIZE = 10;
+    const base::Time TIMEOUT = base::Time::fromSeconds(1.0);
+
+    struct Sample
+    {
+        int stream;
+        base::Time time;
+    };
+
+    /** the period of each stream, between 1 and 4 ms */
+    base::Time getPeriod(int stream)
+    {
+        return base::Time::fromMicroseconds(1000 * (1 + stream % 4));
+    }
+
+    /** computes the order in which the samples of the scenario get pushed */
+    std::vector<Sample> generateSamples(const Scenario &scenario, size_t count)
+    {
+        // next sample of each stream, ordered by the time at which it gets
+        // delivered
+        typedef std::pair<int64_t, int> delivery;
+        std::priority_queue< delivery, std::vector<delivery>, std::greater<delivery> > queue;
+        std::vector<int64_t> next_sample(scenario.streams, 0);
+        for (int i = 0; i < scenario.streams; ++i)
+            queue.push(delivery(0, i));
+
+        std::vector<Sample> result;
+        result.reserve(count);
+        while (result.size() < count)
+        {
+            int stream = queue.top().second;
+            queue.pop();
+
+            int64_t period = getPeriod(stream).toMicroseconds();
+            int burst = scenario.arrival == BURSTY ? BURST_SIZE : 1;
+            for (int i = 0; i < burst && result.size() < count; ++i)
+            {
+                Sample sample = { stream, base::Time::fromMicroseconds(period * (next_sample[stream] + 1)) };
+                result.push_back(sample);
+                next_sample[stream]++;
+            }
+            // a burst is delivered when its last sample is due
+            queue.push(delivery(period * (next_sample[stream] + burst), stream));
+        }
+        return result;
+    }
+
+    int64_t checksum = 0;
+
+    template<typename T>
+    void sink(const base::Time &time, const T &value);
+
+    template<>
+    void sink<int64_t>(const base::Time &time, const int64_t &value)
+    {
+        checksum += value;
+    }
+
+    template<>
+    void sink< std::vector<char> >(const base::Time &time, const std::vector<char> &value)
+    {
+        checksum += value.size() + value[value.size() / 2];
+    }
+
+    template<typename T>
+    T makePayload(size_t size);
+
+    template<>
+    int64_t makePayload<int64_t>(size_t size)
+    {
+        return 42;
+    }
+
+    template<>
+    std::vector<char> makePayload< std::vector<char> >(size_t size)
+    {
+        return std::vector<char>(size, 1);
+    }
+
+    struct Result
+    {
+        size_t samples;
+        double ns_per_sample;
+        double allocations_per_sample;
+        int64_t p50;
+        int64_t p99;
+        int64_t p999;
+        int64_t max;
+    };
+
+    int64_t getPercentile(std::vector<int64_t> &values, double ratio)
+    {
+        size_t index = std::min(values.size() - 1, static_cast<size_t>(ratio * values.size()));
+        std::nth_element(values.begin(), values.begin() + index, values.end());
+        return values[index];
+    }
+
+    template<typename T>
+    Result run(const Scenario &scenario, double scale)
+    {
+        size_t count = std::max<size_t>(scenario.samples * scale, scenario.streams);
+        // the first samples fill the buffers and are not measured
+        size_t warmup = count / 10;
+        std::vector<Sample> samples = generateSamples(scenario, warmup + count);
+        T payload = makePayload<T>(scenario.payload_size);
+
+        StreamAligner aligner(TIMEOUT);
+        std::vector<int> indexes;
+        for (int i = 0; i < scenario.streams; ++i)
+        {
+            int buffer_size = scenario.fixed_buffer ? -1 : 0;
+            indexes.push_back(aligner.registerStream<T>(&sink<T>, buffer_size, getPeriod(i)));
+        }
+
+        std::vector<int64_t> latencies;
+        latencies.reserve(count);
+
+        typedef std::chrono::steady_clock clock;
+        clock::time_point start;
+        size_t allocations = 0;
+        for (size_t i = 0; i < samples.size(); ++i)
+        {
+            if (i == warmup)
+            {
+                allocations = allocation_count;
+                start = clock::now();
+            }
+
+            clock::time_point push_start = clock::now();
+            aligner.push(indexes[samples[i].stream], samples[i].time, payload);
+            while (aligner.step());
+            if (i >= warmup)
+                latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - push_start).count());
+        }
+        int64_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+        allocations = allocation_count - allocations;
+
+        Result result;
+        result.samples = count;
+        result.ns_per_sample = static_cast<double>(duration) / count;
+        result.allocations_per_sample = static_cast<double>(allocations) / count;
+        result.p50 = getPercentile(latencies, 0.5);
+        result.p99 = getPercentile(latencies, 0.99);
+        result.p999 = getPercentile(latencies, 0.999);
+        result.max = *std::max_element(latencies.begin(), latencies.end());
+        return result;
+    }
+
+    std::string getName(const Scenario &scenario)
+    {
+        std::ostringstream name;
+        name << "streams=" << scenario.streams
+            << " payload=" << scenario.payload_size
+            << " arrival=" << (scenario.arrival == BURSTY ? "bursty" : "periodic")
+            << " buffer=" << (scenario.fixed_buffer ? "fixed" : "dynamic");
+        return name.str();
+    }
+
+    /** a log of samples at 1 kHz, with jitter and 1% of lost samples
+     *
+     * There are no bursts: the estimator under-estimates the period of
+     * bursty streams that have no initial period, and the time per sample
+     * would then be the one of a diverging estimate */
+    std::vector<base::Time> generateLog(size_t count)
+    {
+        srand48(42);
+        std::vector<base::Time> result;
+        result.reserve(count);
+        for (size_t i = 0; result.size() < count; ++i)
+        {
+            if (drand48() < 0.01)
+                continue;
+            int64_t delay = drand48() * 300;
+            result.push_back(base::Time::fromMicroseconds(1000 * i + delay));
+        }
+        return result;
+    }
+
+    struct EstimatorResult
+    {
+        size_t samples;
+        double update_ns_per_sample;
+        double batch_ns_per_sample;
+        double update_published_ns_per_sample;
+        double batch_published_ns_per_sample;
+    };
+
+    /** re-stamps the log and returns the time per sample */
+    double timeEstimator(base::Time window, std::vector<base::Time> const &log,
+            bool batch, bool publish)
+    {
+        typedef std::chrono::steady_clock clock;
+        std::vector<base::Time> stamps(log.size());
+        TimestampEstimator estimator(window);
+        estimator.setStatusPublication(publish);
+
+        clock::time_point start = clock::now();
+        if (batch)
+            estimator.updateBatch(&log[0], &stamps[0], log.size());
+        else
+        {
+            for (size_t i = 0; i < log.size(); ++i)
+                stamps[i] = estimator.update(log[i]);
+        }
+        int64_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+        checksum += stamps.back().toMicroseconds();
+        return static_cast<double>(duration) / log.size();
+    }
+
+    EstimatorResult runEstimator(base::Time window, double scale)
+    {
+        EstimatorResult result;
+        result.samples = std::max<size_t>(2000000 * scale, 1);
+        std::vector<base::Time> log = generateLog(result.samples);
+        result.update_ns_per_sample = timeEstimator(window, log, false, false);
+        result.batch_ns_per_sample = timeEstimator(window, log, true, false);
+        result.update_published_ns_per_sample = timeEstimator(window, log, false, true);
+        result.batch_published_ns_per_sample = timeEstimator(window, log, true, true);
+        return result;
+    }
+
+    std::vector<Scenario> getScenarios()
+    {
+        const int stream_counts[] = { 1, 10, 100, 1000 };
+        const size_t payload_sizes[] = { 8, 1024, 1024 * 1024 };
+        const size_t sample_counts[] = { 200000, 50000, 500 };
+
+        std::vector<Scenario> result;
+        for (int p = 0; p < 3; ++p)
+        {
+            for (int s = 0; s < 4; ++s)
+            {
+                // a megabyte per sample with many streams would need
+                // gigabytes of buffers
+                if (payload_sizes[p] > 1024 && stream_counts[s] > 10)
+                    continue;
+
+                // step() is O(streams), keep the run time reasonable
+                size_t samples = sample_counts[p];
+                if (stream_counts[s] >= 1000)
+                    samples /= 10;
+
+                for (int arrival = PERIODIC; arrival <= BURSTY; ++arrival)
+                {
+                    for (int fixed = 1; fixed >= 0; --fixed)
+                    {
+                        Scenario scenario = { stream_counts[s], payload_sizes[p],
+                            static_cast<Arrival>(arrival), fixed == 1, samples };
+                        result.push_back(scenario);
+                    }
+                }
+            }
+        }
+        return result;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    double scale = 1.0;
+    if (argc > 1)
+        scale = std::atof(argv[1]);
+
+    std::vector<Scenario> scenarios = getScenarios();
+    std::cout << "{\n  \"benchmark\": \"streamaligner\",\n  \"scenarios\": [";
+    for (size_t i = 0; i < scenarios.size(); ++i)
+    {
+        const Scenario &scenario = scenarios[i];
+        Result result;
+        if (scenario.payload_size == 8)
+            result = run<int64_t>(scenario, scale);
+        else
+            result = run< std::vector<char> >(scenario, scale);
+
+        std::cout << (i ? ",\n" : "\n")
+            << "    {\"name\": \"" << getName(scenario) << "\""
+            << ", \"streams\": " << scenario.streams
+            << ", \"payload_bytes\": " << scenario.payload_size
+            << ", \"arrival\": \"" << (scenario.arrival == BURSTY ? "bursty" : "periodic") << "\""
+            << ", \"buffer\": \"" << (scenario.fixed_buffer ? "fixed" : "dynamic") << "\""
+            << ", \"samples\": " << result.samples
+            << ", \"ns_per_sample\": " << result.ns_per_sample
+            << ", \"allocations_per_sample\": " << result.allocations_per_sample
+            << ", \"latency_ns\": {\"p50\": " << result.p50
+            << ", \"p99\": " << result.p99
+            << ", \"p999\": " << result.p999
+            << ", \"max\": " << result.max << "}}";
+    }
+    std::cout << "\n  ],\n  \"timestamp_estimator\": [";
+    const int windows[] = { 1, 10, 100 };
+    for (int i = 0; i < 3; ++i)
+    {
+        EstimatorResult result = runEstimator(base::Time::fromSeconds(windows[i]), scale);
+        std::cout << (i ? ",\n" : "\n")
+            << "    {\"name\": \"window=" << windows[i] << "s\""
+            << ", \"window_s\": " << windows[i]
+            << ", \"samples\": " << result.samples
+            << ", \"update_ns_per_sample\": " << result.update_ns_per_sample
+            << ", \"batch_ns_per_sample\": " << result.batch_ns_per_sample
+            << ", \"update_published_ns_per_sample\": " << result.update_published_ns_per_sample
+            << ", \"batch_published_ns_per_sample\": " << result.batch_published_ns_per_sample << "}";
+    }
+    std::cout << "\n  ],\n  \"checksum\": " << checksum << "\n}" << std::endl;
+    return 0;
+}
@@ -2,8 +2,11 @@
 #define BOOST_TEST_MODULE "test_samplereader"
 #define BOOST_AUTO_TEST_MAIN
 
+#include <atomic>
 #include <iostream>
 #include <numeric>
+#include <sstream>
+#include <thread>
 
 #include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
@@ -179,6 +182,61 @@ BOOST_AUTO_TEST_CASE( drop_test )
     lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "" );
 }
 
+BOOST_AUTO_TEST_CASE( reorder_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(5.0) );
+
+    int s1 = reader.registerStream<string>( &test_callback, 5, base::Time() ); 
+    reader.setReorderTolerance( s1, base::Time::fromSeconds(1.0) );
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s1, base::Time::fromSeconds(2.0), string("c") ); 
+    // within the tolerance, gets inserted before c
+    reader.push( s1, base::Time::fromSeconds(1.5), string("b") ); 
+    // outside of the tolerance, gets dropped
+    reader.push( s1, base::Time::fromSeconds(0.5), string("x") ); 
+
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "a" );
+    // b could still be preceded by a reordered sample
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "" );
+
+    reader.push( s1, base::Time::fromSeconds(3.0), string("d") ); 
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "b" );
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "c" );
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "" );
+
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s1).samples_reordered, 1 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s1).samples_backward_in_time, 1 );
+}
+
+string lateSample;
+
+void late_callback( const base::Time &time, const string& sample )
+{
+    lateSample = sample;
+}
+
+BOOST_AUTO_TEST_CASE( late_callback_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    int s1 = reader.registerStream<string>( &test_callback, 5, base::Time() ); 
+    int s2 = reader.registerStream<string>( &test_callback, 5, base::Time() ); 
+    reader.setLateCallback<string>( s2, &late_callback );
+    reader.disableStream( s2 );
+
+    reader.push( s1, base::Time::fromSeconds(2.0), string("a") ); 
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "a" );
+
+    lateSample = "";
+    reader.push( s2, base::Time::fromSeconds(1.0), string("b") ); 
+    BOOST_CHECK_EQUAL( lateSample, "b" );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s2).samples_dropped_late_arriving, 1 );
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "" );
+}
+
 BOOST_AUTO_TEST_CASE( copy_state_test )
 {
     StreamAligner reader; 
@@ -249,6 +307,455 @@ BOOST_AUTO_TEST_CASE( timeout_test )
     lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "" );
 }
 
+BOOST_AUTO_TEST_CASE( stream_timeout_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+
+    int s1 = reader.registerStream<string>( &test_callback, 5, base::Time::fromSeconds(1.0) ); 
+    int s2 = reader.registerStream<string>( &test_callback, 5, base::Time(), -1, "slow", base::Time::fromSeconds(5.0) ); 
+    BOOST_CHECK_EQUAL( reader.getStreamTimeout(s1).toSeconds(), 10.0 );
+    BOOST_CHECK_EQUAL( reader.getStreamTimeout(s2).toSeconds(), 5.0 );
+    reader.setStreamTimeout( s2, base::Time::fromSeconds(1.0) );
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s1, base::Time::fromSeconds(1.5), string("b") ); 
+    // not timed out on s2 yet
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "" );
+
+    // only waits for 1 second on s2 instead of 10
+    reader.push( s1, base::Time::fromSeconds(2.0), string("c") ); 
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "a" );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s1).latency.toSeconds(), 1.0 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s2).timeout.toSeconds(), 1.0 );
+}
+
+BOOST_AUTO_TEST_CASE( adaptive_timeout_test )
+{
+    boost::shared_ptr<SimulatedClock> clock( new SimulatedClock( base::Time::fromSeconds(100.0) ) );
+    StreamAligner reader; 
+    reader.setClock( clock );
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+    reader.setAdaptiveTimeout( 0.9, base::Time::fromSeconds(0.05) );
+
+    int s1 = reader.registerStream<string>( &test_callback, 0, base::Time::fromSeconds(0.01) ); 
+    // not enough samples to estimate the delay yet
+    BOOST_CHECK_EQUAL( reader.getStreamTimeout(s1).toSeconds(), 10.0 );
+
+    // samples arrive 20ms after their timestamp
+    for( int i = 0; i < 50; i++ )
+    {
+	clock->advance( base::Time::fromSeconds(0.01) );
+	reader.push( s1, clock->now() - base::Time::fromSeconds(0.02), string("a") ); 
+    }
+
+    BOOST_CHECK_CLOSE( reader.getStreamTimeout(s1).toSeconds(), 0.07, 1e-6 );
+    BOOST_CHECK_EQUAL( reader.getStatus().timeout.toSeconds(), 10.0 );
+}
+
+BOOST_AUTO_TEST_CASE( max_latency_test )
+{
+    boost::shared_ptr<SimulatedClock> clock( new SimulatedClock( base::Time::fromSeconds(100.0) ) );
+    StreamAligner reader; 
+    reader.setClock( clock );
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+    reader.setMaxLatency( base::Time::fromSeconds(0.5) );
+
+    int s1 = reader.registerStream<string>( &test_callback, 0, base::Time::fromSeconds(2) ); 
+    reader.registerStream<string>( &test_callback, 0, base::Time::fromSeconds(2) ); 
+    BOOST_CHECK( reader.getNextDeadline().isNull() );
+
+    reader.push( s1, base::Time::fromSeconds(10.0), string("a") ); 
+    reader.push( s1, base::Time::fromSeconds(11.0), string("b") ); 
+    BOOST_CHECK_EQUAL( reader.getNextDeadline().toSeconds(), 100.5 );
+
+    // the second stream is expected to have data, and the timeout is not
+    // reached in data time
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "" );
+
+    clock->advance( base::Time::fromSeconds(0.4) );
+    reader.push( s1, base::Time::fromSeconds(12.0), string("c") ); 
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "" );
+
+    // only the samples that were pushed more than 0.5s ago get released
+    clock->advance( base::Time::fromSeconds(0.1) );
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "a" );
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "b" );
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "" );
+    BOOST_CHECK_EQUAL( reader.getNextDeadline().toSeconds(), 100.9 );
+
+    clock->advance( base::Time::fromSeconds(0.4) );
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "c" );
+    BOOST_CHECK( reader.getNextDeadline().isNull() );
+}
+
+BOOST_AUTO_TEST_CASE( published_status_test )
+{
+    boost::shared_ptr<SimulatedClock> clock( new SimulatedClock( base::Time::fromSeconds(100.0) ) );
+    StreamAligner reader; 
+    reader.setClock( clock );
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+    reader.setStatusPublicationPeriod( base::Time::fromSeconds(1.0) );
+
+    int s1 = reader.registerStream<string>( &test_callback, 0, base::Time::fromSeconds(2), -1, "s1" ); 
+    BOOST_CHECK( !reader.hasPublishedStatus() );
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.step();
+    BOOST_REQUIRE( reader.hasPublishedStatus() );
+    BOOST_CHECK_EQUAL( reader.readPublishedStatus().streams.at(s1).name, "s1" );
+    BOOST_CHECK_EQUAL( reader.readPublishedStatus().streams.at(s1).samples_processed, 1 );
+
+    // not published again before the period elapsed
+    reader.push( s1, base::Time::fromSeconds(2.0), string("b") ); 
+    reader.step();
+    BOOST_CHECK_EQUAL( reader.readPublishedStatus().streams.at(s1).samples_processed, 1 );
+
+    clock->advance( base::Time::fromSeconds(1.0) );
+    reader.step();
+    BOOST_CHECK_EQUAL( reader.readPublishedStatus().streams.at(s1).samples_processed, 2 );
+    BOOST_CHECK_EQUAL( reader.readPublishedStatus().time.toSeconds(), 101.0 );
+
+    reader.push( s1, base::Time::fromSeconds(3.0), string("c") ); 
+    reader.publishStatus();
+    BOOST_CHECK_EQUAL( reader.readPublishedStatus().streams.at(s1).samples_received, 3 );
+}
+
+BOOST_AUTO_TEST_CASE( stream_counters_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+    int s1 = reader.registerStream<string>( &test_callback, 0, base::Time::fromSeconds(0.01) ); 
+
+    // the counters are read while the aligner runs, they only increase
+    std::atomic<bool> done( false );
+    int errors = 0, reads = 0;
+    std::thread monitor( [&]()
+    {
+	StreamCounters last;
+	while( !done.load() )
+	{
+	    StreamCounters counters = reader.readStreamCounters( s1 );
+	    if( counters.samples_received < last.samples_received ||
+		    counters.samples_processed < last.samples_processed )
+		++errors;
+	    last = counters;
+	    ++reads;
+	}
+    } );
+
+    for( int i = 0; i < 100000; ++i )
+    {
+	reader.push( s1, base::Time::fromSeconds(1.0 + i * 0.01), string("a") ); 
+	while( reader.step() );
+    }
+    // one late sample
+    reader.push( s1, base::Time::fromSeconds(0.5), string("b") ); 
+    done.store( true );
+    monitor.join();
+
+    BOOST_CHECK_EQUAL( errors, 0 );
+    BOOST_CHECK_GT( reads, 0 );
+    StreamCounters counters = reader.readStreamCounters( s1 );
+    BOOST_CHECK_EQUAL( counters.samples_received, 100001 );
+    BOOST_CHECK_EQUAL( counters.samples_processed, reader.getBufferStatus( s1 ).samples_processed );
+    BOOST_CHECK_EQUAL( counters.samples_dropped_late_arriving, 1 );
+}
+
+BOOST_AUTO_TEST_CASE( latency_histogram_test )
+{
+    LatencyHistogram histogram;
+    BOOST_CHECK( histogram.getPercentile(0.5).isNull() );
+    for( int i = 1; i <= 1000; i++ )
+	histogram.record( base::Time::fromMicroseconds(i * 10) );
+
+    BOOST_CHECK_EQUAL( histogram.getCount(), 1000 );
+    BOOST_CHECK_EQUAL( histogram.getMin().toMicroseconds(), 10 );
+    BOOST_CHECK_EQUAL( histogram.getMax().toMicroseconds(), 10000 );
+    BOOST_CHECK_CLOSE( histogram.getPercentile(0.5).toSeconds(), 0.005, 6.25 );
+    BOOST_CHECK_CLOSE( histogram.getPercentile(0.99).toSeconds(), 0.0099, 6.25 );
+    BOOST_CHECK_EQUAL( histogram.getPercentile(1.0).toMicroseconds(), 10000 );
+
+    histogram.reset();
+    BOOST_CHECK( histogram.empty() );
+}
+
+void advance_clock_callback( SimulatedClock *clock, const base::Time &time, const string& sample )
+{
+    clock->advance( base::Time::fromMilliseconds(2) );
+}
+
+BOOST_AUTO_TEST_CASE( stream_latency_histograms_test )
+{
+    boost::shared_ptr<SimulatedClock> clock( new SimulatedClock( base::Time::fromSeconds(100.0) ) );
+    StreamAligner reader; 
+    reader.setClock( clock );
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+    reader.setLatencyHistograms( true );
+
+    int s1 = reader.registerStream<string>( boost::bind( &advance_clock_callback, clock.get(), _1, _2 ), 0, base::Time::fromSeconds(1) ); 
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s1, base::Time::fromSeconds(2.0), string("b") ); 
+    clock->advance( base::Time::fromMilliseconds(10) );
+    while( reader.step() );
+
+    const StreamLatencyHistograms &histograms( reader.getLatencyHistograms(s1) );
+    BOOST_CHECK_EQUAL( histograms.latency.getCount(), 2 );
+    BOOST_CHECK_EQUAL( histograms.latency.getMax().toSeconds(), 1.0 );
+    BOOST_CHECK_EQUAL( histograms.buffering.getMin().toMicroseconds(), 10000 );
+    BOOST_CHECK_EQUAL( histograms.buffering.getMax().toMicroseconds(), 12000 );
+    BOOST_CHECK_EQUAL( histograms.callback.getMean().toMicroseconds(), 2000 );
+
+    const StreamStatus &status( reader.getBufferStatus(s1) );
+    BOOST_CHECK_EQUAL( status.latency_percentiles.count, 2 );
+    BOOST_CHECK_EQUAL( status.latency_percentiles.max.toSeconds(), 1.0 );
+    BOOST_CHECK_EQUAL( status.buffering_percentiles.max.toMicroseconds(), 12000 );
+    BOOST_CHECK_EQUAL( status.callback_percentiles.p50.toMicroseconds(), 2000 );
+
+    std::ostringstream out;
+    out << reader.getStatus();
+    BOOST_CHECK( out.str().find("callback p50") != std::string::npos );
+
+    reader.resetHistograms();
+    BOOST_CHECK( reader.getLatencyHistograms(s1).callback.empty() );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s1).callback_percentiles.count, 0 );
+}
+
+BOOST_AUTO_TEST_CASE( trace_test )
+{
+    trace::clear();
+    trace::record( "pop", trace::BEGIN, 1 );
+    trace::record( "pop", trace::END, 1 );
+    trace::record( "timeout", trace::INSTANT, -1 );
+
+    std::ostringstream out;
+    trace::dump( out );
+    std::string json = out.str();
+    BOOST_CHECK( json.find("\"traceEvents\"") != std::string::npos );
+    BOOST_CHECK( json.find("\"name\":\"pop\",\"ph\":\"B\"") != std::string::npos );
+    BOOST_CHECK( json.find("\"args\":{\"stream\":1}") != std::string::npos );
+    BOOST_CHECK( json.find("\"name\":\"timeout\",\"ph\":\"i\"") != std::string::npos );
+
+    trace::clear();
+    std::ostringstream empty;
+    trace::dump( empty );
+    BOOST_CHECK( empty.str().find("\"name\"") == std::string::npos );
+}
+
+BOOST_AUTO_TEST_CASE( trace_dump_while_recording_test )
+{
+    // a small ring buffer, so that it wraps around during the dumps
+    trace::setBufferSize( 16 );
+    std::atomic<bool> done( false );
+    std::thread recorder( [&]()
+    {
+	while( !done.load() )
+	{
+	    trace::record( "pop", trace::BEGIN, 1 );
+	    trace::record( "pop", trace::END, 1 );
+	}
+    } );
+
+    // every dumped event is a complete one
+    int errors = 0;
+    for( int i = 0; i < 1000; ++i )
+    {
+	std::ostringstream out;
+	trace::dump( out );
+	std::istringstream lines( out.str() );
+	std::string line;
+	while( std::getline( lines, line ) )
+	{
+	    if( line.find("\"name\"") != std::string::npos &&
+		    line.find("\"name\":\"pop\"") == std::string::npos )
+		++errors;
+	}
+    }
+    done.store( true );
+    recorder.join();
+    trace::setBufferSize( 65536 );
+    BOOST_CHECK_EQUAL( errors, 0 );
+}
+
+BOOST_AUTO_TEST_CASE( period_estimation_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+
+    // no declared period, so no lookahead unless it gets estimated
+    int s1 = reader.registerStream<string>( &test_callback, 0, base::Time() ); 
+    int s2 = reader.registerStream<string>( &test_callback, 0, base::Time() ); 
+    reader.enablePeriodEstimation( s1, base::Time::fromSeconds(1.0) );
+
+    for( int i = 0; i <= 10; i++ )
+	reader.push( s1, base::Time::fromSeconds(1.0 + i * 0.1), string("a") ); 
+    reader.push( s2, base::Time::fromSeconds(2.05), string("b") ); 
+
+    for( int i = 0; i <= 10; i++ )
+    {
+	lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "a" );
+    }
+    BOOST_CHECK_CLOSE( reader.getBufferStatus(s1).period.toSeconds(), 0.1, 1e-3 );
+
+    // the next sample on s1 is expected at 2.1, so b can go without waiting
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "b" );
+}
+
+BOOST_AUTO_TEST_CASE( stall_detection_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+    reader.setStallDetection( 3 );
+
+    int s1 = reader.registerStream<string>( &test_callback, 10, base::Time::fromSeconds(1.0) ); 
+    int s2 = reader.registerStream<string>( &test_callback, 10, base::Time() ); 
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s2, base::Time::fromSeconds(1.5), string("b") ); 
+    reader.push( s2, base::Time::fromSeconds(2.0), string("c") ); 
+    reader.push( s2, base::Time::fromSeconds(3.0), string("d") ); 
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "a" );
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "b" );
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "c" );
+    // s1 is late, but not stalled yet
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "" );
+    BOOST_CHECK( reader.isStreamActive(s1) );
+
+    // more than 3 periods without data on s1
+    reader.push( s2, base::Time::fromSeconds(4.5), string("e") ); 
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "d" );
+    BOOST_CHECK( !reader.isStreamActive(s1) );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s1).stall_count, 1 );
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "e" );
+
+    // new data enables the stream again
+    reader.push( s1, base::Time::fromSeconds(7.0), string("f") ); 
+    BOOST_CHECK( reader.isStreamActive(s1) );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s1).last_stall_duration.toSeconds(), 6.0 );
+}
+
+BOOST_AUTO_TEST_CASE( stall_clear_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+    reader.setStallDetection( 3 );
+
+    int s1 = reader.registerStream<string>( &test_callback, 10, base::Time::fromSeconds(1.0) ); 
+    int s2 = reader.registerStream<string>( &test_callback, 10, base::Time() ); 
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s2, base::Time::fromSeconds(1.5), string("b") ); 
+    reader.push( s2, base::Time::fromSeconds(4.5), string("c") ); 
+    for( int i = 0; i < 3; i++ )
+	reader.step();
+    BOOST_REQUIRE( !reader.isStreamActive(s1) );
+
+    // clearing forgets about the stall
+    reader.clear();
+    BOOST_CHECK( reader.isStreamActive(s1) );
+
+    reader.push( s1, base::Time::fromSeconds(100.0), string("d") ); 
+    BOOST_CHECK( reader.isStreamActive(s1) );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s1).stall_count, 1 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s1).last_stall_duration.toSeconds(), 0.0 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s1).total_stall_duration.toSeconds(), 0.0 );
+}
+
+std::vector<base::Time> watermarks;
+
+void watermark_callback( const base::Time &watermark )
+{
+    watermarks.push_back( watermark );
+}
+
+BOOST_AUTO_TEST_CASE( watermark_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+    reader.setWatermarkCallback( &watermark_callback );
+
+    int s1 = reader.registerStream<string>( &test_callback, 10, base::Time::fromSeconds(1.0) ); 
+    int s2 = reader.registerStream<string>( &test_callback, 10, base::Time::fromSeconds(0.5) ); 
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s2, base::Time::fromSeconds(1.2), string("b") ); 
+    reader.push( s1, base::Time::fromSeconds(2.0), string("c") ); 
+
+    watermarks.clear();
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "a" );
+    BOOST_CHECK_EQUAL( reader.getWatermark().toSeconds(), 1.2 );
+    // the next sample on s2 is expected at 1.7 at the earliest
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "b" );
+    BOOST_CHECK_EQUAL( reader.getWatermark().toSeconds(), 1.7 );
+    lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "" );
+
+    BOOST_REQUIRE_EQUAL( watermarks.size(), 2 );
+    BOOST_CHECK_EQUAL( watermarks[0].toSeconds(), 1.2 );
+    BOOST_CHECK_EQUAL( watermarks[1].toSeconds(), 1.7 );
+}
+
+std::vector<string> samples;
+
+void record_callback( const base::Time &time, const string& sample )
+{
+    samples.push_back( sample );
+}
+
+BOOST_AUTO_TEST_CASE( step_until_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+
+    int s1 = reader.registerStream<string>( &record_callback, 10, base::Time::fromSeconds(1.0) ); 
+    int s2 = reader.registerStream<string>( &record_callback, 10, base::Time::fromSeconds(1.0) ); 
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s1, base::Time::fromSeconds(3.0), string("c") ); 
+    reader.push( s2, base::Time::fromSeconds(2.0), string("b") ); 
+    reader.push( s2, base::Time::fromSeconds(4.0), string("d") ); 
+
+    samples.clear();
+    BOOST_CHECK_EQUAL( reader.stepUntil( base::Time::fromSeconds(3.5) ), 3 );
+    BOOST_REQUIRE_EQUAL( samples.size(), 3 );
+    BOOST_CHECK_EQUAL( samples[0], "a" );
+    BOOST_CHECK_EQUAL( samples[1], "b" );
+    BOOST_CHECK_EQUAL( samples[2], "c" );
+    BOOST_CHECK_EQUAL( reader.getCurrentTime().toSeconds(), 3.5 );
+
+    // everything up to 3.5 is final
+    reader.push( s1, base::Time::fromSeconds(3.2), string("x") ); 
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s1).samples_dropped_late_arriving, 1 );
+
+    BOOST_CHECK_EQUAL( reader.stepUntil( base::Time::fromSeconds(5.0) ), 1 );
+    BOOST_CHECK_EQUAL( samples.back(), "d" );
+
+    // the latest received sample is still the one at 4.0
+    BOOST_CHECK_EQUAL( reader.getCurrentTime().toSeconds(), 5.0 );
+    BOOST_CHECK_EQUAL( reader.getLatestTime().toSeconds(), 4.0 );
+}
+
+BOOST_AUTO_TEST_CASE( step_until_does_not_stall_streams )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+    reader.setStallDetection( 2 );
+
+    int s1 = reader.registerStream<string>( &record_callback, 10, base::Time::fromSeconds(1.0) ); 
+    int s2 = reader.registerStream<string>( &record_callback, 10, base::Time::fromSeconds(1.0) ); 
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s2, base::Time::fromSeconds(1.0), string("b") ); 
+    reader.stepUntil( base::Time::fromSeconds(10.0) );
+
+    // no stream received anything after 1.0, stepping past the data must
+    // not make them look stalled
+    while( reader.step() );
+    BOOST_CHECK( reader.getBufferStatus(s1).active );
+    BOOST_CHECK( reader.getBufferStatus(s2).active );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s1).stall_count, 0 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus(s2).stall_count, 0 );
+}
+
 BOOST_AUTO_TEST_CASE( data_on_same_time_zero_lookahead )
 {
     StreamAligner reader; 
@@ -387,6 +894,38 @@ BOOST_AUTO_TEST_CASE( advanced_timout )
     lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "" );
 }
 
+void extract_value( const double &value, std::vector<double> &fields )
+{
+    fields[0] = value;
+}
+
+BOOST_AUTO_TEST_CASE( window_aggregate_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    int s1 = reader.registerStream<double>( StreamAligner::Stream<double>::callback_t(), 10, base::Time() ); 
+    reader.setWindowAggregate<double>( s1, base::Time::fromSeconds(2.5), &extract_value );
+
+    reader.push( s1, base::Time::fromSeconds(1.0), 1.0 ); 
+    reader.push( s1, base::Time::fromSeconds(2.0), 8.0 ); 
+    reader.push( s1, base::Time::fromSeconds(3.0), 3.0 ); 
+    reader.push( s1, base::Time::fromSeconds(4.0), 5.0 ); 
+    reader.push( s1, base::Time::fromSeconds(5.0), 4.0 ); 
+
+    // samples are only aggregated once they went through the aligner
+    BOOST_CHECK( reader.getWindowAggregate(s1).empty() );
+    while( reader.step() );
+
+    // only the samples at 3, 4 and 5 are within the window
+    const WindowAggregate &aggregate( reader.getWindowAggregate(s1) );
+    BOOST_CHECK_EQUAL( aggregate.size(), 3 );
+    BOOST_CHECK_CLOSE( aggregate.getMean(), 4.0, 1e-9 );
+    BOOST_CHECK_CLOSE( aggregate.getVariance(), 1.0, 1e-9 );
+    BOOST_CHECK_EQUAL( aggregate.getMin(), 3.0 );
+    BOOST_CHECK_EQUAL( aggregate.getMax(), 5.0 );
+}
+
 template <class T>
 struct pull_object
 {
@@ -4,13 +4,21 @@
 
 #include <iostream>
 #include <numeric>
+#include <cmath>
+#include <limits.h>
 
 #include <boost/test/unit_test.hpp>
 #include <boost/test/execution_monitor.hpp>  
 
 #include <aggregator/TimestampEstimator.hpp>
+#include <aggregator/TimestampEstimatorBank.hpp>
+#include <aggregator/LowerEnvelopeQueue.hpp>
+#include <deque>
 #include <fstream>
 #include <iomanip>
+#include <sstream>
+#include <atomic>
+#include <thread>
 
 using namespace aggregator;
 
@@ -30,6 +38,567 @@ BOOST_AUTO_TEST_CASE(test_perfect_stream)
     BOOST_REQUIRE_CLOSE(step.toSeconds(), estimator.getPeriod().toSeconds(), 1e-6);
 }
 
+BOOST_AUTO_TEST_CASE(test_clock)
+{
+    boost::shared_ptr<SimulatedClock> clock(new SimulatedClock(base::Time::fromSeconds(100)));
+    base::Time step = base::Time::fromSeconds(0.01);
+
+    TimestampEstimator estimator(base::Time::fromSeconds(2), 0);
+    estimator.setClock(clock);
+    for (int i = 0; i < 1000; ++i)
+    {
+        clock->advance(step);
+        BOOST_REQUIRE_CLOSE(clock->now().toSeconds(), estimator.update().toSeconds(), 0.0000001);
+    }
+    BOOST_REQUIRE_CLOSE(step.toSeconds(), estimator.getPeriod().toSeconds(), 1e-6);
+}
+
+BOOST_AUTO_TEST_CASE(test_lower_envelope_queue)
+{
+    srand48(42);
+    LowerEnvelopeQueue queue;
+    std::deque<LowerEnvelopeQueue::Line> lines;
+    int64_t seq = 0;
+    for (int round = 0; round < 3; ++round)
+    {
+        // lines sample - seq * period as pushed by TimestampEstimator, and
+        // popped in the same order
+        for (int i = 0; i < 3000; ++i)
+        {
+            if (lines.empty() || drand48() < 0.6)
+            {
+                LowerEnvelopeQueue::Line line = { seq * 0.01 + drand48() * 0.003, -static_cast<double>(seq), seq };
+                queue.push(line.a, line.b, line.id);
+                lines.push_back(line);
+                ++seq;
+            }
+            else
+            {
+                BOOST_REQUIRE_EQUAL(lines.front().id, queue.front().id);
+                queue.pop();
+                lines.pop_front();
+            }
+            BOOST_REQUIRE_EQUAL(lines.size(), queue.size());
+            if (lines.empty())
+                continue;
+
+            double x = (i % 2) ? 0.0095 + drand48() * 0.001 : drand48() * 0.02;
+            size_t best = 0;
+            for (size_t j = 1; j < lines.size(); ++j)
+            {
+                if (lines[j].at(x) <= lines[best].at(x))
+                    best = j;
+            }
+            double minimum = lines[best].at(x);
+            BOOST_REQUIRE_SMALL(queue.getMinimum(x).at(x) - minimum, 1e-9);
+
+            std::vector<LowerEnvelopeQueue::Line> minima;
+            queue.getMinima(x, 1e-9, minima);
+            bool has_best = false;
+            for (size_t j = 0; j < minima.size(); ++j)
+            {
+                BOOST_REQUIRE_LE(minima[j].at(x), minimum + 1e-9);
+                has_best = has_best || minima[j].id == lines[best].id;
+            }
+            BOOST_REQUIRE(has_best);
+        }
+
+        // empty the queue, it must be usable again afterwards
+        while (!lines.empty())
+        {
+            BOOST_REQUIRE_EQUAL(lines.front().id, queue.front().id);
+            queue.pop();
+            lines.pop_front();
+        }
+        BOOST_REQUIRE(queue.empty());
+        BOOST_REQUIRE_THROW(queue.pop(), std::logic_error);
+        BOOST_REQUIRE_THROW(queue.front(), std::logic_error);
+        BOOST_REQUIRE_THROW(queue.getMinimum(0.01), std::logic_error);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_incremental_searches)
+{
+    // update() checks its incremental searches against linear scans of the
+    // window, on streams with lost samples, bursts and early samples
+    srand48(42);
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        TimestampEstimator estimator(base::Time::fromSeconds(1));
+        estimator.setSelfCheck(true);
+        if (mode)
+            estimator.setPeriodEstimation(TimestampEstimator::PERIOD_LEAST_SQUARES);
+
+        base::Time time = base::Time::fromSeconds(1000);
+        for (int i = 0; i < 20000; ++i)
+        {
+            if (drand48() < 0.05)
+                continue;
+            double delay = drand48() * 0.003;
+            if (i % 500 < 5)
+                delay += 0.05;
+            if (drand48() < 0.01)
+                delay -= 0.02;
+            BOOST_REQUIRE_NO_THROW(estimator.update(time + base::Time::fromSeconds(0.01 * i + delay)));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_least_squares_period)
+{
+    srand48(42);
+    base::Time time = base::Time::fromSeconds(1000);
+    double step = 0.01;
+
+    TimestampEstimator endpoints(base::Time::fromSeconds(1), INT_MAX);
+    TimestampEstimator least_squares(base::Time::fromSeconds(1), INT_MAX);
+    least_squares.setPeriodEstimation(TimestampEstimator::PERIOD_LEAST_SQUARES);
+    BOOST_REQUIRE_EQUAL(TimestampEstimator::PERIOD_LEAST_SQUARES, least_squares.getPeriodEstimation());
+
+    double endpoints_error = 0, least_squares_error = 0;
+    for (int i = 0; i < 10000; ++i)
+    {
+        base::Time sample = time + base::Time::fromSeconds(step * i + drand48() * step * 0.3);
+        endpoints.update(sample);
+        least_squares.update(sample);
+        if (i >= 200)
+        {
+            endpoints_error += pow(endpoints.getPeriod().toSeconds() - step, 2);
+            least_squares_error += pow(least_squares.getPeriod().toSeconds() - step, 2);
+        }
+    }
+
+    BOOST_REQUIRE_CLOSE(step, least_squares.getPeriod().toSeconds(), 1);
+    BOOST_REQUIRE_LT(least_squares_error, endpoints_error / 4);
+
+    // the least-squares sums are not maintained with PERIOD_FROM_ENDPOINTS,
+    // they are rebuilt from the window when switching
+    endpoints.setPeriodEstimation(TimestampEstimator::PERIOD_LEAST_SQUARES);
+    BOOST_REQUIRE_CLOSE(least_squares.getPeriod().toSeconds(), endpoints.getPeriod().toSeconds(), 1e-6);
+    for (int i = 10000; i < 10200; ++i)
+    {
+        base::Time sample = time + base::Time::fromSeconds(step * i + drand48() * step * 0.3);
+        endpoints.update(sample);
+        least_squares.update(sample);
+    }
+    BOOST_REQUIRE_CLOSE(least_squares.getPeriod().toSeconds(), endpoints.getPeriod().toSeconds(), 1e-6);
+}
+
+BOOST_AUTO_TEST_CASE(test_period_drift)
+{
+    srand48(42);
+    base::Time time = base::Time::fromSeconds(1000);
+    double step = 0.01;
+    double step_drift = 2e-6;
+
+    TimestampEstimator least_squares(base::Time::fromSeconds(2), INT_MAX);
+    least_squares.setPeriodEstimation(TimestampEstimator::PERIOD_LEAST_SQUARES);
+    TimestampEstimator drift(base::Time::fromSeconds(2), INT_MAX);
+    drift.setPeriodEstimation(TimestampEstimator::PERIOD_DRIFT);
+
+    int const COUNT = 3000;
+    for (int i = 0; i < COUNT; ++i)
+    {
+        double t = step * i + step_drift * i * (i + 1) / 2;
+        base::Time sample = time + base::Time::fromSeconds(t + drand48() * step * 0.1);
+        least_squares.update(sample);
+        drift.update(sample);
+    }
+
+    // the period between the last two samples
+    double period = step + step_drift * (COUNT - 1);
+    BOOST_REQUIRE_CLOSE(period, drift.getPeriod().toSeconds(), 1);
+    BOOST_REQUIRE_CLOSE(step_drift / period, drift.getPeriodDrift(), 10);
+    // the linear fit gives the average period over the window instead
+    BOOST_REQUIRE_GT(fabs(least_squares.getPeriod().toSeconds() - period), 5 * fabs(drift.getPeriod().toSeconds() - period));
+    BOOST_REQUIRE_EQUAL(0, least_squares.getPeriodDrift());
+}
+
+BOOST_AUTO_TEST_CASE(test_update_batch)
+{
+    srand48(42);
+    std::vector<base::Time> times;
+    std::vector<int64_t> indexes;
+    base::Time time = base::Time::fromSeconds(1000);
+    for (int i = 0; i < 20000; ++i)
+    {
+        // 1% of lost samples, and a burst every 500 samples
+        if (drand48() < 0.01)
+            continue;
+        double delay = drand48() * 0.003;
+        if (i % 500 < 5)
+            delay += 0.05;
+        times.push_back(time + base::Time::fromSeconds(0.01 * i + delay));
+        indexes.push_back(i);
+    }
+
+    TimestampEstimator sequential(base::Time::fromSeconds(2));
+    TimestampEstimator batch(base::Time::fromSeconds(2));
+    std::vector<base::Time> result(times.size());
+    batch.updateBatch(&times[0], &result[0], times.size());
+    for (size_t i = 0; i < times.size(); ++i)
+        BOOST_REQUIRE_EQUAL(sequential.update(times[i]).toMicroseconds(), result[i].toMicroseconds());
+    BOOST_REQUIRE_EQUAL(sequential.getPeriod().toMicroseconds(), batch.getPeriod().toMicroseconds());
+
+    sequential.reset();
+    batch.reset();
+    batch.updateBatch(&times[0], &indexes[0], &result[0], times.size());
+    for (size_t i = 0; i < times.size(); ++i)
+        BOOST_REQUIRE_EQUAL(sequential.update(times[i], indexes[i]).toMicroseconds(), result[i].toMicroseconds());
+    BOOST_REQUIRE_EQUAL(sequential.getLostSampleCount(), batch.getLostSampleCount());
+}
+
+/** Returns \c state with the value at \c offset replaced by \c value */
+template<typename T>
+std::string corruptState(std::string state, size_t offset, T value)
+{
+    state.replace(offset, sizeof(T), reinterpret_cast<char const*>(&value), sizeof(T));
+    return state;
+}
+
+BOOST_AUTO_TEST_CASE(test_save_load)
+{
+    srand48(42);
+    base::Time time = base::Time::fromSeconds(1000);
+    double step = 0.01;
+    base::Time latency = base::Time::fromSeconds(0.003);
+
+    TimestampEstimator estimator(base::Time::fromSeconds(2));
+    int i = 0;
+    for (; i < 1000; ++i)
+    {
+        // 1% of lost samples
+        if (drand48() < 0.01)
+            continue;
+        base::Time reference = time + base::Time::fromSeconds(step * i);
+        estimator.update(reference + latency + base::Time::fromSeconds(drand48() * step * 0.2));
+        estimator.updateReference(reference);
+    }
+
+    std::stringstream state;
+    estimator.save(state);
+    TimestampEstimator restored;
+    restored.load(state);
+    BOOST_REQUIRE_EQUAL(estimator.getPeriod().toMicroseconds(), restored.getPeriod().toMicroseconds());
+    BOOST_REQUIRE_EQUAL(estimator.getLatency().toMicroseconds(), restored.getLatency().toMicroseconds());
+    BOOST_REQUIRE_EQUAL(estimator.getLostSampleCount(), restored.getLostSampleCount());
+
+    // the restored estimator continues as the saved one would have
+    for (; i < 2000; ++i)
+    {
+        base::Time reference = time + base::Time::fromSeconds(step * i);
+        base::Time sample = reference + latency + base::Time::fromSeconds(drand48() * step * 0.2);
+        BOOST_REQUIRE_SMALL((estimator.update(sample) - restored.update(sample)).toSeconds(), 1e-6);
+        estimator.updateReference(reference);
+        restored.updateReference(reference);
+    }
+
+    // after a restart longer than the window, the saved period is kept and
+    // the reference is used right away
+    std::stringstream restart_state;
+    estimator.save(restart_state);
+    TimestampEstimator warm;
+    warm.load(restart_state);
+    i += 1000;
+    base::Time reference = time + base::Time::fromSeconds(step * i);
+    warm.updateReference(reference);
+    base::Time stamp = warm.update(reference + latency);
+    BOOST_REQUIRE_CLOSE(step, warm.getPeriod().toSeconds(), 1);
+    BOOST_REQUIRE_SMALL((stamp - reference).toSeconds(), 1e-6);
+
+    // a failed load leaves the estimator unchanged, whether it fails on
+    // the parameters or on the samples, because the state is truncated or
+    // has invalid fields
+    warm.setStatusPublication(true);
+    std::stringstream warm_state;
+    warm.save(warm_state);
+    base::Time warm_period = warm.getPeriod();
+    std::string full = restart_state.str();
+    std::vector<std::string> invalid_states;
+    invalid_states.push_back(full.substr(0, 20));
+    invalid_states.push_back(full.substr(0, full.size() / 2));
+    invalid_states.push_back(full.substr(0, full.size() - 1));
+    // the offsets follow the layout written by TimestampEstimator::save()
+    invalid_states.push_back(corruptState<int32_t>(full, 16, 3));
+    invalid_states.push_back(corruptState<int32_t>(full, 16, -1));
+    invalid_states.push_back(corruptState<double>(full, 20, 0));
+    invalid_states.push_back(corruptState<double>(full, 20, -2));
+    invalid_states.push_back(corruptState<double>(full, 20, std::nan("")));
+    invalid_states.push_back(corruptState<double>(full, 28, -0.01));
+    invalid_states.push_back(corruptState<double>(full, 28, 1e-12));
+    uint32_t lost_size;
+    full.copy(reinterpret_cast<char*>(&lost_size), sizeof(lost_size), 130);
+    size_t capacity_offset = 134 + 8 * lost_size;
+    uint32_t capacity;
+    full.copy(reinterpret_cast<char*>(&capacity), sizeof(capacity), capacity_offset);
+    invalid_states.push_back(corruptState<uint32_t>(full, capacity_offset, UINT_MAX));
+    invalid_states.push_back(corruptState<uint32_t>(full, capacity_offset + 4, capacity + 1));
+    invalid_states.push_back(corruptState<uint32_t>(full, capacity_offset + 4, UINT_MAX));
+    for (size_t t = 0; t < invalid_states.size(); ++t)
+    {
+        std::istringstream invalid_state(invalid_states[t]);
+        BOOST_REQUIRE_THROW(warm.load(invalid_state), std::runtime_error);
+
+        std::stringstream after_state;
+        warm.save(after_state);
+        BOOST_REQUIRE(warm_state.str() == after_state.str());
+        BOOST_REQUIRE_EQUAL(warm_period.toMicroseconds(), warm.getPeriod().toMicroseconds());
+        BOOST_REQUIRE_EQUAL(warm.getStatus().stamp.toMicroseconds(), warm.readPublishedStatus().stamp.toMicroseconds());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_published_status)
+{
+    srand48(42);
+    base::Time time = base::Time::fromSeconds(1000);
+    double step = 0.001;
+    TimestampEstimator estimator(base::Time::fromSeconds(1));
+    estimator.setStatusPublication(true);
+
+    // the reader checks that every snapshot comes from a single update, i.e.
+    // that the raw times only increase and that the window is consistent
+    std::atomic<bool> done(false);
+    int errors = 0, reads = 0;
+    std::thread reader([&]()
+    {
+        base::Time last_raw;
+        while (!done.load())
+        {
+            TimestampEstimatorStatus status = estimator.readPublishedStatus();
+            if (status.time_raw < last_raw || status.window_size > status.window_capacity ||
+                    (!status.time_raw.isNull() && status.stamp > status.time_raw))
+                ++errors;
+            last_raw = status.time_raw;
+            ++reads;
+        }
+    });
+
+    for (int i = 0; i < 200000; ++i)
+        estimator.update(time + base::Time::fromSeconds(step * i + drand48() * step * 0.2));
+    done.store(true);
+    reader.join();
+
+    BOOST_REQUIRE_EQUAL(0, errors);
+    BOOST_REQUIRE_GT(reads, 0);
+    TimestampEstimatorStatus status = estimator.getStatus();
+    TimestampEstimatorStatus published = estimator.readPublishedStatus();
+    BOOST_REQUIRE_EQUAL(status.stamp.toMicroseconds(), published.stamp.toMicroseconds());
+    BOOST_REQUIRE_EQUAL(status.period.toMicroseconds(), published.period.toMicroseconds());
+    BOOST_REQUIRE_EQUAL(status.window_size, published.window_size);
+
+    estimator.reset();
+    BOOST_REQUIRE(estimator.readPublishedStatus().time_raw.isNull());
+
+    // nothing is published once disabled
+    estimator.setStatusPublication(false);
+    estimator.update(time);
+    BOOST_REQUIRE(estimator.readPublishedStatus().time_raw.isNull());
+}
+
+BOOST_AUTO_TEST_CASE(test_predict_next)
+{
+    srand48(42);
+    base::Time time = base::Time::fromSeconds(1000);
+    double step = 0.01;
+    double max_jitter = step * 0.2;
+    base::Time latency = base::Time::fromSeconds(0.003);
+
+    TimestampEstimator estimator(base::Time::fromSeconds(2));
+    base::Time earliest, latest;
+    BOOST_REQUIRE(estimator.predictNext().isNull());
+    BOOST_REQUIRE(!estimator.getArrivalInterval(earliest, latest));
+
+    int in_interval = 0;
+    for (int i = 0; i < 3000; ++i)
+    {
+        base::Time reference = time + base::Time::fromSeconds(step * i);
+        base::Time sample = reference + latency + base::Time::fromSeconds(drand48() * max_jitter);
+        if (i >= 2000)
+        {
+            BOOST_REQUIRE_SMALL((estimator.predictNext() - reference).toSeconds(), 5e-4);
+            BOOST_REQUIRE_SMALL((estimator.predictNext(3) - reference - base::Time::fromSeconds(2 * step)).toSeconds(), 5e-4);
+            BOOST_REQUIRE_SMALL((estimator.expectedArrival() - reference - latency).toSeconds(), 5e-4);
+            BOOST_REQUIRE(estimator.getArrivalInterval(earliest, latest));
+            if (earliest <= sample + base::Time::fromMicroseconds(100) && sample <= latest)
+                ++in_interval;
+        }
+        estimator.updateReference(reference);
+        estimator.update(sample);
+    }
+
+    // the maximum includes the first window, where the estimate is still
+    // converging
+    BOOST_REQUIRE_LT(estimator.getMaxJitter().toSeconds(), step);
+    BOOST_REQUIRE_GE(estimator.getMaxJitter().toSeconds(), max_jitter * 0.9);
+    // the interval is bounded by the 99% quantile of the jitter
+    BOOST_REQUIRE_GE(in_interval, 960);
+    BOOST_REQUIRE_LT(in_interval, 1000);
+}
+
+BOOST_AUTO_TEST_CASE(test_outlier_rejection)
+{
+    srand48(42);
+    base::Time time = base::Time::fromSeconds(1000);
+    double step = 0.01;
+
+    TimestampEstimator plain(base::Time::fromSeconds(5));
+    TimestampEstimator robust(base::Time::fromSeconds(5));
+    robust.setOutlierRejection(10);
+    BOOST_REQUIRE_EQUAL(10, robust.getOutlierThreshold());
+
+    // every 97th sample is delayed by more than a period once the jitter
+    // statistics are available, and groups of three samples get lost after
+    // the first 3000 samples
+    int plain_errors = 0, robust_errors = 0, outliers = 0, losses = 0;
+    int last_loss = -1000;
+    for (int i = 0; i < 6000; ++i)
+    {
+        if (i >= 3000 && i % 500 < 3)
+        {
+            losses++;
+            last_loss = i;
+            continue;
+        }
+
+        base::Time reference = time + base::Time::fromSeconds(step * i);
+        base::Time sample = reference + base::Time::fromSeconds(drand48() * step * 0.1);
+        bool outlier = (i >= 1000 && i % 97 == 96);
+        if (outlier)
+            sample = sample + base::Time::fromSeconds(step * 1.5);
+
+        base::Time plain_stamp = plain.update(sample);
+        base::Time robust_stamp = robust.update(sample);
+        // give the loss detection a few samples to pick up the losses
+        if (i < 1000 || i - last_loss <= 8)
+            continue;
+
+        // the outliers are stamped as if they had no jitter
+        if (outlier)
+        {
+            outliers++;
+            if (std::fabs((robust_stamp - reference).toSeconds()) > step / 10)
+                robust_errors++;
+        }
+        else
+        {
+            if (std::fabs((plain_stamp - reference).toSeconds()) > step / 10)
+                plain_errors++;
+            if (std::fabs((robust_stamp - reference).toSeconds()) > step / 10)
+                robust_errors++;
+        }
+    }
+
+    BOOST_REQUIRE_EQUAL(0, robust_errors);
+    BOOST_REQUIRE_GT(plain_errors, 100);
+    BOOST_REQUIRE_GE(robust.getOutlierCount(), outliers);
+    BOOST_REQUIRE_EQUAL(losses, robust.getLostSampleCount());
+    BOOST_REQUIRE_EQUAL(robust.getOutlierCount(), robust.getStatus().outliers_total);
+}
+
+BOOST_AUTO_TEST_CASE(test_estimator_bank)
+{
+    srand48(42);
+    const size_t channels = 50;
+    std::vector<size_t> indexes;
+    std::vector<base::Time> times;
+    base::Time time = base::Time::fromSeconds(1000);
+    for (int i = 0; i < 2000; ++i)
+    {
+        for (size_t c = 0; c < channels; ++c)
+        {
+            indexes.push_back(c);
+            times.push_back(time + base::Time::fromSeconds((0.01 + 0.001 * c) * i + drand48() * 0.001));
+        }
+    }
+
+    TimestampEstimatorBank bank(channels, TimestampEstimator(base::Time::fromSeconds(1)));
+    BOOST_REQUIRE_EQUAL(channels, bank.size());
+    std::vector<TimestampEstimatorStatus> status;
+    bank.getStatus(status);
+    BOOST_REQUIRE_EQUAL(channels, status.size());
+    BOOST_REQUIRE(status[0].period.isNull());
+
+    std::vector<base::Time> expected(times.size());
+    bank.update(&indexes[0], &times[0], &expected[0], times.size());
+    for (size_t c = 0; c < channels; ++c)
+        BOOST_REQUIRE_CLOSE(0.01 + 0.001 * c, bank.getStatus(c).period.toSeconds(), 1);
+
+    // the windows grew out of their slots, and are the same as the ones of
+    // standalone estimators, once packed again or not
+    std::vector<TimestampEstimator> standalone(channels, TimestampEstimator(base::Time::fromSeconds(1)));
+    for (size_t i = 0; i < times.size(); ++i)
+        BOOST_REQUIRE_EQUAL(expected[i].toMicroseconds(), standalone[indexes[i]].update(times[i]).toMicroseconds());
+    bank.packWindows();
+    for (size_t c = 0; c < channels; ++c)
+    {
+        base::Time next = times[times.size() - channels + c] + base::Time::fromSeconds(0.01 + 0.001 * c);
+        BOOST_REQUIRE_EQUAL(standalone[c].update(next).toMicroseconds(), bank.update(c, next).toMicroseconds());
+    }
+
+    // the worker threads are reused across calls
+    bank.reset();
+    bank.setThreadCount(4);
+    BOOST_REQUIRE_EQUAL(4, bank.getThreadCount());
+    std::vector<base::Time> result(times.size());
+    size_t half = times.size() / 2;
+    bank.update(&indexes[0], &times[0], &result[0], half);
+    bank.update(&indexes[half], &times[half], &result[half], times.size() - half);
+    for (size_t i = 0; i < times.size(); ++i)
+        BOOST_REQUIRE_EQUAL(expected[i].toMicroseconds(), result[i].toMicroseconds());
+
+    // more threads than channels
+    bank.reset();
+    bank.setThreadCount(channels + 10);
+    bank.update(&indexes[0], &times[0], &result[0], times.size());
+    for (size_t i = 0; i < times.size(); ++i)
+        BOOST_REQUIRE_EQUAL(expected[i].toMicroseconds(), result[i].toMicroseconds());
+
+    size_t invalid = channels;
+    BOOST_REQUIRE_THROW(bank.update(&invalid, &times[0], &result[0], 1), std::runtime_error);
+
+    // a copy of a channel's estimator stays valid after the bank got
+    // destroyed
+    std::vector<TimestampEstimator> copies;
+    {
+        TimestampEstimatorBank packed(2, TimestampEstimator(base::Time::fromSeconds(1), base::Time::fromSeconds(0.01)));
+        for (int i = 0; i < 50; ++i)
+            packed.update(0, time + base::Time::fromSeconds(0.01 * i));
+        copies.push_back(packed.getEstimator(0));
+    }
+    for (int i = 50; i < 200; ++i)
+    {
+        base::Time sample = time + base::Time::fromSeconds(0.01 * i);
+        BOOST_REQUIRE_EQUAL(sample.toMicroseconds(), copies[0].update(sample).toMicroseconds());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_arena_allocator)
+{
+    typedef boost::circular_buffer<int64_t, ArenaAllocator<int64_t> > Buffer;
+    std::shared_ptr<char> storage(new char[80], std::default_delete<char[]>());
+    std::shared_ptr<ArenaSlot> slot(new ArenaSlot(storage, 0, 80));
+
+    Buffer buffer(10, ArenaAllocator<int64_t>(slot));
+    for (int i = 0; i < 10; ++i)
+        buffer.push_back(i);
+    BOOST_REQUIRE_EQUAL(static_cast<void*>(slot->data), static_cast<void*>(buffer.linearize()));
+
+    // a copy shares the slot, and uses the heap while the slot is in use
+    Buffer copy(buffer);
+    BOOST_REQUIRE_NE(static_cast<void*>(slot->data), static_cast<void*>(copy.linearize()));
+    BOOST_REQUIRE(std::equal(buffer.begin(), buffer.end(), copy.begin()));
+
+    // a buffer that grows out of the slot moves to the heap, and frees the
+    // slot for another buffer
+    buffer.set_capacity(20);
+    BOOST_REQUIRE_NE(static_cast<void*>(slot->data), static_cast<void*>(buffer.linearize()));
+    BOOST_REQUIRE(!slot->used);
+    copy.set_capacity(9);
+    BOOST_REQUIRE_EQUAL(static_cast<void*>(slot->data), static_cast<void*>(copy.linearize()));
+    BOOST_REQUIRE_EQUAL(9, copy.size());
+    BOOST_REQUIRE_EQUAL(0, copy.front());
+}
+
 /**
  * helper class for unit testing
  * This class calculates the sample time,
@@ -184,9 +753,17 @@ void test_timestamper_impl(int hardware_order, bool has_initial_period, bool has
     if (has_initial_period)
         initial_period = base::Time::fromSeconds(0.025);
     
+    // the drift estimation is meant to keep the same accuracy with a much
+    // shorter window
+    base::Time window = base::Time::fromSeconds(20);
+    if (has_drift)
+        window = base::Time::fromSeconds(5);
+
     //estimator for testing
-    TimestampEstimator estimator(base::Time::fromSeconds(20),
+    TimestampEstimator estimator(window,
 	initial_period);
+    if (has_drift)
+        estimator.setPeriodEstimation(TimestampEstimator::PERIOD_DRIFT);
     
     for (int i = 0; i < COUNT; ++i)
     {
@@ -234,18 +811,23 @@ BOOST_AUTO_TEST_CASE(test_timestamper__hw_after)
 { test_timestamper_impl(1, false, false, 1000, 0); }
 BOOST_AUTO_TEST_CASE(test_timestamper__initial_period)
 { test_timestamper_impl(0, true, false, 0, 0); }
-// BOOST_AUTO_TEST_CASE(test_timestamper__hw_before__initial_period__drift)
-// { test_timestamper_impl(-1, true, true, 0, 0); }
-// BOOST_AUTO_TEST_CASE(test_timestamper__hw_before__drift)
-// { test_timestamper_impl(-1, false, true, 1000, 0); }
-// BOOST_AUTO_TEST_CASE(test_timestamper__hw_after__initial_period__drift)
-// { test_timestamper_impl(1, true, true, 0, 0); }
-// BOOST_AUTO_TEST_CASE(test_timestamper__hw_after__drift)
-// { test_timestamper_impl(1, false, true, 1000, 0); }
+BOOST_AUTO_TEST_CASE(test_timestamper__hw_before__initial_period__drift)
+{ test_timestamper_impl(-1, true, true, 0, 0); }
+BOOST_AUTO_TEST_CASE(test_timestamper__hw_before__drift)
+{ test_timestamper_impl(-1, false, true, 1000, 0); }
+BOOST_AUTO_TEST_CASE(test_timestamper__hw_after__initial_period__drift)
+{ test_timestamper_impl(1, true, true, 0, 0); }
+BOOST_AUTO_TEST_CASE(test_timestamper__hw_after__drift)
+{ test_timestamper_impl(1, false, true, 1000, 0); }
+// Checked from the first sample, this cannot pass: the samples are 0.1
+// period away from the initial period's prediction after 13 samples, while
+// the jitter is up to 0.2 period. The drift cannot be told apart from the
+// jitter that early, so the error exceeds the 0.1 period bound on some of
+// the first samples whatever the estimator does
 // BOOST_AUTO_TEST_CASE(test_timestamper__initial_period__drift)
 // { test_timestamper_impl(0, true, true, 0, 0); }
-// BOOST_AUTO_TEST_CASE(test_timestamper__drift)
-// { test_timestamper_impl(0, false, true, 1000, 0); }
+BOOST_AUTO_TEST_CASE(test_timestamper__drift)
+{ test_timestamper_impl(0, false, true, 1000, 0); }
 
 BOOST_AUTO_TEST_CASE(test_timestamper__hw_before__initial_period__loss_updateLoss)
 { test_timestamper_impl(-1, true, false, 0, 0.01, USE_UPDATE_LOSS); }
@@ -272,6 +854,9 @@ BOOST_AUTO_TEST_CASE(test_timestamper__initial_period__loss_index)
 { test_timestamper_impl(0, true, false, 0, 0.01, USE_INDEX); }
 BOOST_AUTO_TEST_CASE(test_timestamper__loss_index)
 { test_timestamper_impl(0, false, false, 1000, 0.01, USE_INDEX); }
+// Unannounced losses are only detected after lost_threshold late samples,
+// which are stamped a period early in the meantime. This fails with a
+// constant period as well, and is why there are no plain *__loss tests
 // BOOST_AUTO_TEST_CASE(test_timestamper__hw_before__initial_period__drift__loss)
 // { test_timestamper_impl(-1, true, true, 0, 0.01); }
 // BOOST_AUTO_TEST_CASE(test_timestamper__hw_before__drift__loss)
@@ -285,3 +870,27 @@ BOOST_AUTO_TEST_CASE(test_timestamper__loss_index)
 // BOOST_AUTO_TEST_CASE(test_timestamper__drift__loss)
 // { test_timestamper_impl(0, false, true, 1000, 0.01); }
 
+// There is no initial_period__drift__loss_* test, for the same reason as
+// test_timestamper__initial_period__drift
+BOOST_AUTO_TEST_CASE(test_timestamper__hw_before__initial_period__drift__loss_updateLoss)
+{ test_timestamper_impl(-1, true, true, 0, 0.01, USE_UPDATE_LOSS); }
+BOOST_AUTO_TEST_CASE(test_timestamper__hw_before__drift__loss_updateLoss)
+{ test_timestamper_impl(-1, false, true, 1000, 0.01, USE_UPDATE_LOSS); }
+BOOST_AUTO_TEST_CASE(test_timestamper__hw_after__initial_period__drift__loss_updateLoss)
+{ test_timestamper_impl(1, true, true, 0, 0.01, USE_UPDATE_LOSS); }
+BOOST_AUTO_TEST_CASE(test_timestamper__hw_after__drift__loss_updateLoss)
+{ test_timestamper_impl(1, false, true, 1000, 0.01, USE_UPDATE_LOSS); }
+BOOST_AUTO_TEST_CASE(test_timestamper__drift__loss_updateLoss)
+{ test_timestamper_impl(0, false, true, 1000, 0.01, USE_UPDATE_LOSS); }
+
+BOOST_AUTO_TEST_CASE(test_timestamper__hw_before__initial_period__drift__loss_index)
+{ test_timestamper_impl(-1, true, true, 0, 0.01, USE_INDEX); }
+BOOST_AUTO_TEST_CASE(test_timestamper__hw_before__drift__loss_index)
+{ test_timestamper_impl(-1, false, true, 1000, 0.01, USE_INDEX); }
+BOOST_AUTO_TEST_CASE(test_timestamper__hw_after__initial_period__drift__loss_index)
+{ test_timestamper_impl(1, true, true, 0, 0.01, USE_INDEX); }
+BOOST_AUTO_TEST_CASE(test_timestamper__hw_after__drift__loss_index)
+{ test_timestamper_impl(1, false, true, 1000, 0.01, USE_INDEX); }
+BOOST_AUTO_TEST_CASE(test_timestamper__drift__loss_index)
+{ test_timestamper_impl(0, false, true, 1000, 0.01, USE_INDEX); }
+